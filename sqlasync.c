@@ -30,6 +30,8 @@
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 
 
@@ -63,10 +65,19 @@ struct sqlasync_wakeup_t {
 	sqlasync_wakeup_func_t wakeup;
 	sqlasync_wakeup_func_t schedule;
 	void *data;
-	sqlasync_result_t *first;
-	sqlasync_result_t *last;
+	/* Round-robin list of queues with results ready for dispatch, linked
+	 * through sqlasync_queue_t.rnext. */
+	sqlasync_queue_t *first;
+	sqlasync_queue_t *last;
 	unsigned int numscheduled; /* Number of queries scheduled */
 	unsigned int haswoken;
+	/* Set by sqlasync_wakeup_budget(), zero if unlimited */
+	unsigned int budget;
+	unsigned int budgettime; /* microseconds */
+	/* Number of results taken with sqlasync_queue_get() during the current
+	 * sqlasync_dispatch(), which counts against `budget'. */
+	unsigned int dispatching;
+	unsigned int taken;
 };
 
 
@@ -90,11 +101,30 @@ struct sqlasync_queue_t {
 	sqlasync_result_t *last;
 	unsigned int numscheduled;
 	unsigned int destroyed;
-	/* Holds the total number of queued results associated with this object. In
-	 * the asynchronous case, that includes results queued in `first'/`last'
-	 * in addition to those in queued in the wakeup object. */
+	/* Holds the total number of queued results associated with this object. */
 	unsigned int numresults;
+	/* For async results: The number of results at the head of the queue that
+	 * may be dispatched. With `each' set to 0 the results of a query are
+	 * buffered until its last result arrives. `ready' is set while the queue
+	 * is in the wakeup object's dispatch list. */
+	unsigned int avail;
+	unsigned int ready;
+	sqlasync_queue_t *rnext;
+	/* Readiness pipe of a sync queue, see sqlasync_queue_fd(). -1 if it
+	 * hasn't been created. */
+	int fd[2];
 	unsigned int maxresults;
+	/* Incremented by sqlasync_cancel(), accessed atomically */
+	unsigned int cancelled;
+	/* Set by sqlasync_queue_timeout(), zero if there is no deadline */
+	struct timespec timeout;
+	/* Merging queue created by sqlasync_router_all(). Results are passed on
+	 * to `target', except for the `last' results: Only the one of the last
+	 * remaining shard is passed on, replaced with the first error, if any.
+	 * `pending' and `error' are protected by `lock'. */
+	sqlasync_queue_t *target;
+	sqlasync_result_t *error;
+	unsigned int pending;
 };
 
 
@@ -103,6 +133,33 @@ struct sqlasync_queue_t {
 #define SQLASYNC_CLOSE   (2<<8)
 #define SQLASYNC_QUIT    (3<<8)
 #define SQLASYNC_CUSTOM  (4<<8)
+/* Cursor operations, these can be combined with the bufmanage flags and
+ * SQLASYNC_PRIO. args[0] = cursor */
+#define SQLASYNC_CURSOR_OPEN  (5<<8) /* args[1..] = bind values */
+#define SQLASYNC_CURSOR_NEXT  (6<<8) /* args[1] = number of rows */
+#define SQLASYNC_CURSOR_CLOSE (7<<8)
+#define SQLASYNC_BACKUP       (8<<8) /* args[0] = pages per step, args[1] = pause */
+#define SQLASYNC_SUBSCRIBE    (9<<8) /* args[0..] = table names */
+#define SQLASYNC_UNSUBSCRIBE  (10<<8)
+
+#define sqlasync_special(f) ((f) & (15<<8))
+
+/* Internal modifier flags, these can be combined with the public flags */
+#define SQLASYNC_MANY    (1<<12) /* args[0] = nrows, args[1..] = nrows*ncols bind values */
+#define SQLASYNC_LAYOUT  (1<<13) /* args[0] = layout, args[1] = batch size, args[2..] = bind values */
+#define SQLASYNC_VISIT   (1<<14) /* args[0] = visitor, args[1] = data, args[2..] = bind values */
+
+#define sqlasync_bufmanage(f) ((f) & 3)
+
+/* Number of virtual machine instructions between calls to the progress
+ * handler. */
+#define SQLASYNC_PROGRESS_OPS 1000
+
+/* Busy timeout of the checkpoint connection, in milliseconds */
+#define SQLASYNC_CKPT_BUSY 100
+
+/* Number of pages copied to the file per step of sqlasync_persist() */
+#define SQLASYNC_PERSIST_PAGES 256
 
 typedef struct sqlasync_op_t sqlasync_op_t;
 struct sqlasync_op_t {
@@ -110,33 +167,333 @@ struct sqlasync_op_t {
 	sqlasync_queue_t *q;
 	char *str;
 	unsigned short flags;
-	unsigned short numargs;
+	unsigned short pool; /* Pool bucket, SQLASYNC_POOL_BUCKETS if not pooled */
+	/* Time of submission, only set when instrumentation is enabled */
+	struct timespec queued;
+	/* Value of q->cancelled at the time of submission */
+	unsigned int cancelgen;
+	/* Time when the operation should be aborted, zero if no deadline */
+	struct timespec deadline;
+	unsigned int numargs;
 	sqlasync_value_t args[];
 };
 
 
+#define sqlasync_timespec_isset(t) ((t).tv_sec != 0 || (t).tv_nsec != 0)
+#define sqlasync_havetranstimeout(s) sqlasync_timespec_isset((s)->transtimeout)
+
+static inline struct timespec sqlasync_timespec_add(struct timespec a, struct timespec b) {
+	a.tv_sec += b.tv_sec;
+	a.tv_nsec += b.tv_nsec;
+	if(a.tv_nsec >= 1000000000) {
+		a.tv_sec++;
+		a.tv_nsec -= 1000000000;
+	}
+	return a;
+}
+
+/* Whether time `a' is before `b' */
+static inline int sqlasync_timespec_before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Whether the given CLOCK_MONOTONIC time has passed */
+static inline int sqlasync_timespec_passed(const struct timespec *t) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > t->tv_sec || (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+/* Microseconds elapsed since the given time */
+static inline unsigned long long sqlasync_elapsed_us(const struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec)*1000000LL + (now.tv_nsec - since->tv_nsec)/1000;
+}
+
+
+/* Operation objects are kept in a pool after use, bucketed by the number of
+ * arguments they have room for: 0, 1, 2, 4, 8 and 16. */
+#define SQLASYNC_POOL_BUCKETS 6
+#define SQLASYNC_POOL_MAX     64 /* Per bucket */
+#define sqlasync_pool_size(b) ((b) ? 1u<<((b)-1) : 0u)
+
+
+/* Interned query string. The application only sees the `str' member. */
+typedef struct sqlasync_intern_t sqlasync_intern_t;
+struct sqlasync_intern_t {
+	sqlasync_intern_t *next;
+	/* Cached prepared statement, only accessed by the database thread */
+	sqlite3_stmt *st;
+	char str[];
+};
+
+#define sqlasync_intern_get(_str) ((sqlasync_intern_t *)((_str) - offsetof(sqlasync_intern_t, str)))
+
+
+/* A cursor, only accessed by the database thread. `q' is set on creation and
+ * never modified. */
+struct sqlasync_cursor_t {
+	sqlasync_cursor_t *next; /* List of cursors that haven't been closed */
+	sqlasync_queue_t *q;
+	sqlite3_stmt *st;
+	/* All rows have been returned, `st' has been reset */
+	unsigned int done : 1;
+};
+
+
+/* Change data capture subscriber, see sqlasync_subscribe(). Only accessed by
+ * the database thread. */
+typedef struct sqlasync_sub_t sqlasync_sub_t;
+struct sqlasync_sub_t {
+	sqlasync_sub_t *next;
+	sqlasync_queue_t *q;
+	/* Names of the tables to report, each zero-terminated. All tables if
+	 * tableslen == 0. */
+	char *tables;
+	size_t tableslen;
+};
+
+/* A change made by the current transaction. `name' is the offset of the table
+ * name in sqlasync_t.cdcnames. */
+typedef struct {
+	int op;
+	sqlite3_int64 rowid;
+	size_t name;
+} sqlasync_change_t;
+
+/* A savepoint started by the application, see sqlasync_thread_cdc_stmt() */
+typedef struct {
+	char *name;
+	size_t mark;
+} sqlasync_cdcsp_t;
+
+
+/* Cached result set, see sqlasync_cache(). The key consists of the query
+ * string followed by the bind values, see sqlasync_cache_key(). */
+#define SQLASYNC_CACHE_BUCKETS 256
+
+typedef struct sqlasync_centry_t sqlasync_centry_t;
+struct sqlasync_centry_t {
+	sqlasync_centry_t *next; /* Hash chain */
+	sqlasync_centry_t *lprev, *lnext; /* LRU list, most recently used first */
+	unsigned int hash;
+	size_t mem;
+	/* Results, linked with their `next' field */
+	sqlasync_result_t *res;
+	/* Names of the tables read by the query, each zero-terminated */
+	char *tables;
+	size_t tableslen;
+	size_t keylen;
+	char key[];
+};
+
+
+/* A result held back until the current transaction has been committed, see
+ * sqlasync_thread_final() and sqlasync_thread_result() */
+typedef struct sqlasync_held_t sqlasync_held_t;
+struct sqlasync_held_t {
+	sqlasync_held_t *next;
+	sqlasync_queue_t *q;
+	sqlasync_result_t *res;
+	/* The `last' result of a SQLASYNC_DURABLE query, as opposed to a result
+	 * that is only held to keep the results on its queue in order. */
+	int durable;
+};
+
+
+/* Aggregated statistics for a single query string */
+#define SQLASYNC_QSTAT_BUCKETS 256
+#define SQLASYNC_QSTAT_MAX     1024 /* Queries beyond this number are not aggregated */
+
+typedef struct sqlasync_qstat_t sqlasync_qstat_t;
+struct sqlasync_qstat_t {
+	sqlasync_qstat_t *next;
+	unsigned long long count, queue_time, exec_time, rows, fullscan_steps, sorts, vm_steps;
+	char query[];
+};
+
+
 struct sqlasync_t {
 	pthread_t thread;
 	struct timespec transtimeout;
 
+	/* Group commit policy, see sqlasync_group(). `groupops' is the current
+	 * operation limit, which differs from `groupmaxops' in adaptive mode. */
+	unsigned int groupmaxops, groupmaxbytes, groupops;
+	int groupflags;
+
+	/* PRAGMA statements run after opening the database, see sqlasync_tune() */
+	char *tunesql;
+
+	/* Busy handling policy, in milliseconds. See sqlasync_busy(). */
+	unsigned int busymin, busymax, busytimeout;
+	/* State of the current busy wait, only used by the database thread */
+	unsigned int busynext;
+	unsigned int busyseed;
+	struct timespec busystart;
+
+	/* Background checkpointing, see sqlasync_checkpoint(). The thread is only
+	 * running while `ckptdb' is set, which is only accessed by the database
+	 * thread. The connection itself belongs to the checkpoint thread while it
+	 * is running. `ckptlock' protects `ckptpending' and `ckptquit'. */
+	unsigned int ckptenabled, ckptmaxwal;
+	int ckptmode;
+	pthread_t ckptthread;
+	pthread_mutex_t ckptlock;
+	pthread_cond_t ckptcond;
+	sqlite3 *ckptdb;
+	unsigned int ckptpending, ckptquit;
+	/* A transaction has been committed since the last checkpoint request, set
+	 * by the commit hook */
+	unsigned int ckptdirty : 1;
+
+	/* Result cache, see sqlasync_cache(). `cachelock' protects the hash table
+	 * and the LRU list. */
+	pthread_mutex_t cachelock;
+	size_t cachemax, cachemem;
+	sqlasync_centry_t *cache[SQLASYNC_CACHE_BUCKETS];
+	sqlasync_centry_t *lrufirst, *lrulast;
+	/* Results and tables captured from the current operation, and the tables
+	 * it has written to. Only accessed by the database thread. */
+	char *capkey;
+	size_t capkeylen, capmem;
+	struct {
+		sqlasync_result_t *first;
+		sqlasync_result_t *last;
+	} capres;
+	char *captables, *dirty;
+	size_t captableslen, dirtylen;
+
+	/* Protects `stats'. Only the database and checkpoint threads write to it. */
+	pthread_mutex_t statslock;
+	sqlasync_stats_t stats;
+
+	/* Instrumentation, see sqlasync_instrument() and sqlasync_slowlog() */
+	unsigned int instrumented;
+	sqlasync_instrument_func_t instrumentfunc;
+	void *instrumentdata;
+	sqlasync_queue_t *slowq;
+	unsigned int slowtime;
+	/* Per-query aggregates and the number of rows returned by the current
+	 * operation, only accessed by the database thread. */
+	sqlasync_qstat_t *qstats[SQLASYNC_QSTAT_BUCKETS];
+	unsigned int qstatnum;
+	unsigned int oprows;
+
+	/* Submitted operations, in LIFO order, one stack for each priority lane
+	 * (index 1 is for SQLASYNC_PRIO). These stacks are lock-free: Other
+	 * threads push onto them with a compare-and-swap, and the database thread
+	 * takes an entire stack at once.
+	 * COMPAT: This uses the __atomic builtins, available since GCC 4.7 and
+	 * Clang 3.1. */
+	sqlasync_op_t *submitted[2];
+	/* Operations taken from `submitted', in FIFO order. Only accessed by the
+	 * database thread. */
+	struct {
+		sqlasync_op_t *first;
+		sqlasync_op_t *last;
+	} lanes[2];
+
+	/* Held between sqlasync_lock() and sqlasync_unlock(), protects `chain'.
+	 * Operations queued while locked are collected in `chain' and submitted
+	 * as a whole when unlocking. */
 	pthread_mutex_t lock;
+	struct {
+		sqlasync_op_t *first;
+		sqlasync_op_t *last;
+	} chain;
+
+	/* Used by the database thread to wait for new operations. `sleeping' is
+	 * set while it is (about to be) waiting on the condition, so that the
+	 * submitting threads only need to signal when that is the case. */
+	pthread_mutex_t waitlock;
 	pthread_cond_t cond;
-	sqlasync_op_t *first;
-	sqlasync_op_t *last;
+	unsigned int sleeping;
+
+	/* Pool of free operation objects. Any thread may add objects to a bucket:
+	 * the database thread after processing an operation, and a submitting
+	 * thread after serving a query from the cache. Taking an object from a
+	 * bucket is done by whichever thread manages to set `poolbusy', others
+	 * simply fall back to malloc(). Having only a single thread remove objects
+	 * at a time avoids the ABA problem, concurrent additions are fine. */
+	sqlasync_op_t *pool[SQLASYNC_POOL_BUCKETS];
+	unsigned int poolbusy[SQLASYNC_POOL_BUCKETS];
+	unsigned int poolnum[SQLASYNC_POOL_BUCKETS];
+
+	/* List of interned queries, protected by internlock */
+	pthread_mutex_t internlock;
+	sqlasync_intern_t *interned;
 
 	sqlite3 *db;
 	/* The queue given to sqlasync_open() */
 	sqlasync_queue_t *dbqueue;
+	/* Cursors that haven't been closed with sqlasync_cursor_close() */
+	sqlasync_cursor_t *cursors;
+	/* Change data capture, see sqlasync_subscribe(). Changes made by the
+	 * current transaction are logged in `cdc', and discarded again when
+	 * (part of) the transaction is rolled back. `cdcmark' is the size of the
+	 * log at the start of our own savepoint, `cdcsp' are the savepoints
+	 * started by the application. `cdccommit' is set by the commit hook. */
+	sqlasync_sub_t *subs;
+	sqlasync_change_t *cdc;
+	size_t cdclen, cdcsize, cdcmark;
+	char *cdcnames;
+	size_t cdcnameslen, cdcnamessize;
+	sqlasync_cdcsp_t *cdcsp;
+	size_t cdcsplen, cdcspsize;
+	unsigned int cdccommit : 1;
+	/* Online backup in progress, see sqlasync_backup() */
+	struct {
+		sqlite3 *db;
+		sqlite3_backup *b;
+		sqlasync_queue_t *q;
+		int pages;
+		struct timespec pause, next, start;
+	} backup;
+	/* Write-behind persistence of an in-memory database, see
+	 * sqlasync_persist(). `db' is the connection to the file, `b' the copy in
+	 * progress. `dirty' is set by the commit hook. */
+	struct {
+		sqlite3 *db;
+		sqlite3_backup *b;
+		struct timespec interval, next;
+		unsigned int enabled : 1, dirty : 1;
+	} persist;
 	/* Cached prepared staments for common queries */
 	sqlite3_stmt *begin, *commit, *rollback;
+	sqlite3_stmt *savepoint, *release, *rollbackto;
+	/* Last held result before the current savepoint was started */
+	sqlasync_held_t *savepointheld;
+	/* Operation that is currently being executed, checked by the progress
+	 * handler. `abortmsg' is set when the operation has been aborted. */
+	sqlasync_op_t *curop;
+	const char *abortmsg;
 	/* Time when the current transaction should be committed */
 	struct timespec trans;
+	/* Time when the current transaction has been started */
+	struct timespec transstart;
+	/* Number of operations and bytes of bound data in the current transaction */
+	unsigned int transops, transbytes;
+	/* `last' results of SQLASYNC_DURABLE queries that are waiting for the
+	 * current transaction to be committed, and any later results for the same
+	 * queues. */
+	struct {
+		sqlasync_held_t *first;
+		sqlasync_held_t *last;
+	} held;
 	/* Set when a transaction is currently open */
 	unsigned int intrans : 1;
 	/* We're in a SQLASYNC_NEXT chain, but the transaction had to be rolled back due to an error. */
 	unsigned int errtrans : 1;
 	/* Previous operation was a SQLASYNC_NEXT */
 	unsigned int donext : 1;
+	/* Lane of the previous operation */
+	unsigned int lane : 1;
+	/* A savepoint is active within the current transaction */
+	unsigned int insavepoint : 1;
+	/* The results of the current operation are captured for the cache */
+	unsigned int capturing : 1;
 };
 
 
@@ -159,12 +516,23 @@ void sqlasync_wakeup_destroy(sqlasync_wakeup_t *w) {
 }
 
 
+void *sqlasync_wakeup_data(sqlasync_wakeup_t *w) {
+	return w->data;
+}
+
+
 sqlasync_queue_t *sqlasync_queue_sync() {
 	sqlasync_queue_t *q = calloc(1, sizeof(sqlasync_queue_t));
 	pthread_mutex_init(&q->lock, NULL);
-	pthread_cond_init(&q->cond, NULL);
+	/* For the timeout of sqlasync_queue_getn() */
+	pthread_condattr_t cattr;
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
 	q->sync = 1;
 	q->maxresults = UINT_MAX;
+	q->fd[0] = q->fd[1] = -1;
 	return q;
 }
 
@@ -187,6 +555,115 @@ sqlasync_queue_t *sqlasync_queue_buffersize(sqlasync_queue_t *q, unsigned int le
 }
 
 
+sqlasync_queue_t *sqlasync_queue_timeout(sqlasync_queue_t *q, const struct timespec *timeout) {
+	/* Same as above, no need to lock */
+	if(timeout)
+		q->timeout = *timeout;
+	else
+		memset(&q->timeout, 0, sizeof(q->timeout));
+	return q;
+}
+
+
+/* Append an async queue to the dispatch list of its wakeup object, if it isn't
+ * in there already. Must be called with the wakeup lock held. */
+static void sqlasync_queue_ready(sqlasync_queue_t *q) {
+	sqlasync_wakeup_t *w = q->wakeup;
+	if(q->ready)
+		return;
+	q->ready = 1;
+	q->rnext = NULL;
+	if(w->last)
+		w->last->rnext = q;
+	else
+		w->first = q;
+	w->last = q;
+}
+
+
+/* The readiness pipe of a sync queue holds a single byte while the queue is
+ * not empty. Must be called with the queue lock held, when the queue has
+ * become non-empty (ready=1) or empty (ready=0). */
+static void sqlasync_queue_notify(sqlasync_queue_t *q, int ready) {
+	char c = 0;
+	if(q->fd[0] < 0)
+		return;
+	if(ready)
+		while(write(q->fd[1], &c, 1) < 0 && errno == EINTR)
+			;
+	else
+		while(read(q->fd[0], &c, 1) < 0 && errno == EINTR)
+			;
+}
+
+
+int sqlasync_queue_fd(sqlasync_queue_t *q) {
+	assert("Readiness fd is only available for sync queues" && q->sync);
+	pthread_mutex_lock(&q->lock);
+	if(q->fd[0] < 0) {
+		if(pipe(q->fd) == 0) {
+			int i;
+			for(i=0; i<2; i++) {
+				fcntl(q->fd[i], F_SETFL, fcntl(q->fd[i], F_GETFL) | O_NONBLOCK);
+				fcntl(q->fd[i], F_SETFD, FD_CLOEXEC);
+			}
+			if(q->first)
+				sqlasync_queue_notify(q, 1);
+		} else
+			q->fd[0] = q->fd[1] = -1;
+	}
+	int fd = q->fd[0];
+	pthread_mutex_unlock(&q->lock);
+	return fd;
+}
+
+
+int sqlasync_queue_getn(sqlasync_queue_t *q, sqlasync_result_t **res, int max, int timeout) {
+	assert("sqlasync_queue_getn() can only be used on sync queues" && q->sync);
+	struct timespec deadline;
+	int n = 0, r = 0;
+	if(timeout > 0) {
+		struct timespec t = { timeout / 1000, (timeout % 1000) * 1000000 };
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline = sqlasync_timespec_add(deadline, t);
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while(!q->first && timeout && r != ETIMEDOUT)
+		r = timeout < 0
+			? pthread_cond_wait(&q->cond, &q->lock)
+			: pthread_cond_timedwait(&q->cond, &q->lock, &deadline);
+
+	while(q->first && n < max) {
+		sqlasync_result_t *x = q->first;
+		queue_pop(q);
+		q->numresults--;
+		if(x->last)
+			q->numscheduled--;
+		x->queue = NULL;
+		x->next = NULL;
+		res[n++] = x;
+	}
+	if(n) {
+		/* Room for more than one result may have become available */
+		pthread_cond_broadcast(&q->cond);
+		if(!q->first)
+			sqlasync_queue_notify(q, 0);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+
+sqlasync_result_t *sqlasync_queue_tryget(sqlasync_queue_t *q) {
+	sqlasync_result_t *res = NULL;
+	if(!q->sync)
+		return sqlasync_queue_get(q);
+	sqlasync_queue_getn(q, &res, 1, 0);
+	return res;
+}
+
+
 sqlasync_result_t *sqlasync_queue_get(sqlasync_queue_t *q) {
 	sqlasync_result_t *res = NULL;
 	int shouldwakeup = 0;
@@ -198,9 +675,18 @@ sqlasync_result_t *sqlasync_queue_get(sqlasync_queue_t *q) {
 			pthread_cond_wait(&q->cond, lock);
 		res = q->first;
 		queue_pop(q);
-	} else if(q->wakeup->first && q->wakeup->first->queue == q) {
-		res = q->wakeup->first;
-		queue_pop(q->wakeup);
+		if(!q->first)
+			sqlasync_queue_notify(q, 0);
+	} else if(q->avail) {
+		sqlasync_wakeup_t *w = q->wakeup;
+		/* Once the budget is spent the remaining results are left for the
+		 * next dispatch, the queue is still in the dispatch list. */
+		if(!w->dispatching || !w->budget || w->taken < w->budget) {
+			res = q->first;
+			queue_pop(q);
+			q->avail--;
+			w->taken += w->dispatching;
+		}
 	}
 
 	if(res) {
@@ -242,48 +728,118 @@ static void sqlasync_queue_schedule(sqlasync_queue_t *q) {
 }
 
 
+/* Whether nothing but the query that is being submitted is scheduled for this
+ * queue, i.e. a result passed back now can't overtake the results of an
+ * earlier query. */
+static int sqlasync_queue_idle(sqlasync_queue_t *q) {
+	pthread_mutex_t *lock = q->sync ? &q->lock : &q->wakeup->lock;
+	pthread_mutex_lock(lock);
+	int idle = q->numscheduled <= 1;
+	pthread_mutex_unlock(lock);
+	return idle;
+}
+
+
 /* Called only when the queue is empty and no more results are scheduled. */
 static void sqlasync_queue_free(sqlasync_queue_t *q) {
 	if(q->sync) {
 		pthread_mutex_destroy(&q->lock);
 		pthread_cond_destroy(&q->cond);
+		if(q->fd[0] >= 0) {
+			close(q->fd[0]);
+			close(q->fd[1]);
+		}
 	}
 	free(q);
 }
 
 
+/* The cancel generation of a queue. Merging queues are cancelled together with
+ * their target. */
+#define sqlasync_cancelgen(q) __atomic_load_n(&((q)->target ? (q)->target : (q))->cancelled, __ATOMIC_RELAXED)
+
+
+void sqlasync_cancel(sqlasync_queue_t *q) {
+	__atomic_add_fetch(&q->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+
 void sqlasync_queue_destroy(sqlasync_queue_t *q) {
 	if(!q)
 		return;
-	int shouldfree = 0;
+	int shouldfree = 0, shouldwakeup = 0;
 	pthread_mutex_t *lock = q->sync ? &q->lock : &q->wakeup->lock;
 	pthread_mutex_lock(lock);
 	q->destroyed = 1;
 
-	/* We can already immediately free the queue that is directly associated
-	 * with this queue item. Results associated with a wakeup object are freed
-	 * in the dispatch function. */
+	/* Results that have not been dispatched yet are not going to be, free them
+	 * now and take the queue out of the wakeup object's dispatch list. */
 	while(q->first) {
 		sqlasync_result_t *r = q->first;
 		queue_pop(q);
 		q->numresults--;
-		/* There's no need to decrement q->wakeup->numscheduled if !q->sync,
-		 * because this queue will act as temporary a buffer in that case and
-		 * there will not be a 'last' result. */
-		if(r->last)
+		if(r->last) {
 			q->numscheduled--;
+			if(!q->sync && !--q->wakeup->numscheduled && !q->wakeup->haswoken)
+				shouldwakeup = q->wakeup->haswoken = 1;
+		}
 		sqlasync_result_free(r);
 	}
+	q->avail = 0;
 	pthread_cond_signal(&q->cond);
+	if(q->sync)
+		sqlasync_queue_notify(q, 0);
+
+	if(q->ready) {
+		sqlasync_queue_t **p = &q->wakeup->first, *prev = NULL;
+		while(*p != q) {
+			prev = *p;
+			p = &(*p)->rnext;
+		}
+		*p = q->rnext;
+		if(q->wakeup->last == q)
+			q->wakeup->last = prev;
+		q->ready = 0;
+	}
 
 	shouldfree = !q->numscheduled && !q->numresults;
 	pthread_mutex_unlock(lock);
 
+	if(shouldwakeup)
+		q->wakeup->wakeup(q->wakeup, q->wakeup->data);
 	if(shouldfree)
 		sqlasync_queue_free(q);
 }
 
 
+/* Handles a result for a merging queue. Called by multiple database threads. */
+static void sqlasync_queue_merge(sqlasync_queue_t *q, sqlasync_result_t *r) {
+	if(!r->last) {
+		sqlasync_queue_result(q->target, r);
+		return;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	if(!q->error && r->result != SQLITE_DONE && r->result != SQLITE_OK) {
+		q->error = r;
+		r = NULL;
+	}
+	int done = !--q->pending;
+	pthread_mutex_unlock(&q->lock);
+
+	if(!done) {
+		sqlasync_result_free(r);
+		return;
+	}
+	if(q->error) {
+		sqlasync_result_free(r);
+		r = q->error;
+	}
+	sqlasync_queue_result(q->target, r);
+	sqlasync_queue_free(q);
+}
+
+
 /* Called from the database thread when a result has become available.
  * TODO: This is also called when no queue has been specified or when the queue
  * has already been destroyed.  It'd be much more efficient to communicate back
@@ -293,6 +849,10 @@ void sqlasync_queue_result(sqlasync_queue_t *q, sqlasync_result_t *r) {
 		sqlasync_result_free(r);
 		return;
 	}
+	if(q->target) {
+		sqlasync_queue_merge(q, r);
+		return;
+	}
 	sqlasync_wakeup_t *w = q->wakeup;
 	int shouldwakeup = 0, shouldfree = 0;
 	pthread_mutex_t *lock = q->sync ? &q->lock : &q->wakeup->lock;
@@ -314,20 +874,17 @@ void sqlasync_queue_result(sqlasync_queue_t *q, sqlasync_result_t *r) {
 	q->numresults++;
 
 	if(q->sync) {
+		if(!q->first)
+			sqlasync_queue_notify(q, 1);
 		queue_push(q, r, r);
 		pthread_cond_signal(&q->cond);
 		goto final;
 	}
 
-	r->queue = q;
-	if(!q->each && !r->last) /* Buffer */
-		queue_push(q, r, r);
-	if(!q->each && r->last && q->first) { /* Unbuffer */
-		queue_push(w, q->first, q->last);
-		q->first = q->last = NULL;
-	}
+	queue_push(q, r, r);
 	if(q->each || r->last) {
-		queue_push(w, r, r);
+		q->avail = q->numresults;
+		sqlasync_queue_ready(q);
 		shouldwakeup = 1;
 	}
 
@@ -346,37 +903,66 @@ final:
 
 
 void sqlasync_dispatch(sqlasync_wakeup_t *w) {
+	struct timespec start;
+	unsigned int n = 0;
+	if(w->budgettime)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 	pthread_mutex_lock(&w->lock);
+	w->dispatching = 1;
+	w->taken = 0;
 	while(w->first) {
-		sqlasync_result_t *res = w->first;
-		sqlasync_queue_t *q = res->queue;
-
-		if(q->destroyed) {
-			queue_pop(w);
-			q->numresults--;
-			if(res->last) {
-				q->numscheduled--;
-				w->numscheduled--;
-			}
-			sqlasync_result_free(res);
-			if(!q->numscheduled && !q->numresults)
-				sqlasync_queue_free(q);
-		} else {
-			/* The callback may call any sqlasync_* function other than
-			 * sqlasync_wakeup_destroy(w). That includes freeing the queue object,
-			 * emptying our queue and scheduling more events. So we have to be
-			 * careful to not assume much about our state after calling this. */
-			pthread_mutex_unlock(&w->lock);
-			q->func(q, q->data);
-			pthread_mutex_lock(&w->lock);
-		}
+		if(w->budget && w->taken >= w->budget)
+			break;
+		if(w->budgettime && n && sqlasync_elapsed_us(&start) >= w->budgettime)
+			break;
+
+		/* Move the queue to the back of the list before running its callback,
+		 * so that a queue with many results can't starve the others. A queue
+		 * whose results have been consumed in the meantime is dropped here. */
+		sqlasync_queue_t *q = w->first;
+		w->first = q->rnext;
+		if(!w->first)
+			w->last = NULL;
+		q->ready = 0;
+		if(!q->avail)
+			continue;
+		sqlasync_queue_ready(q);
+
+		/* The callback may call any sqlasync_* function other than
+		 * sqlasync_wakeup_destroy(w). That includes freeing the queue object,
+		 * emptying our queue and scheduling more events. So we have to be
+		 * careful to not assume much about our state after calling this. */
+		pthread_mutex_unlock(&w->lock);
+		q->func(q, q->data);
+		pthread_mutex_lock(&w->lock);
+		n++;
+	}
+	w->dispatching = 0;
+	/* Out of budget, ask for another dispatch rather than holding up the
+	 * event loop. */
+	while(w->first && !w->first->avail) {
+		w->first->ready = 0;
+		w->first = w->first->rnext;
+		if(!w->first)
+			w->last = NULL;
 	}
-	w->haswoken = 0;
+	int shouldwakeup = w->haswoken = !!w->first;
 	int shouldschedule = !!w->numscheduled;
 	pthread_mutex_unlock(&w->lock);
 
 	if(shouldschedule && w->schedule)
 		w->schedule(w, w->data);
+	if(shouldwakeup)
+		w->wakeup(w, w->data);
+}
+
+
+void sqlasync_wakeup_budget(sqlasync_wakeup_t *w, unsigned int results, unsigned int usec) {
+	pthread_mutex_lock(&w->lock);
+	w->budget = results;
+	w->budgettime = usec;
+	pthread_mutex_unlock(&w->lock);
 }
 
 
@@ -401,59 +987,113 @@ void sqlasync_result_free(sqlasync_result_t *r) {
 }
 
 
-static sqlasync_op_t *sqlasync_op_create(sqlasync_queue_t *q, const char *str, int flags, unsigned short numargs) {
-	sqlasync_op_t *op = malloc(offsetof(sqlasync_op_t, args) + (numargs * sizeof(sqlasync_value_t)));
+static sqlasync_op_t *sqlasync_op_create(sqlasync_t *s, sqlasync_queue_t *q, const char *str, int flags, unsigned int numargs) {
+	sqlasync_op_t *op = NULL;
+	unsigned int b = 0;
+	while(b < SQLASYNC_POOL_BUCKETS && sqlasync_pool_size(b) < numargs)
+		b++;
+
+	if(b < SQLASYNC_POOL_BUCKETS && !__atomic_exchange_n(&s->poolbusy[b], 1, __ATOMIC_ACQUIRE)) {
+		op = __atomic_load_n(&s->pool[b], __ATOMIC_ACQUIRE);
+		while(op && !__atomic_compare_exchange_n(&s->pool[b], &op, op->next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			;
+		__atomic_store_n(&s->poolbusy[b], 0, __ATOMIC_RELEASE);
+		if(op)
+			__atomic_sub_fetch(&s->poolnum[b], 1, __ATOMIC_RELAXED);
+	}
+	if(!op)
+		op = malloc(offsetof(sqlasync_op_t, args) +
+			((b < SQLASYNC_POOL_BUCKETS ? sqlasync_pool_size(b) : numargs) * sizeof(sqlasync_value_t)));
+
 	op->next = NULL;
 	op->q = q;
-	if(!str || (flags & (SQLASYNC_STATIC|SQLASYNC_FREE)))
+	if(!str || sqlasync_bufmanage(flags) != SQLASYNC_COPY)
 		op->str = (char *)str;
 	else {
 		op->str = malloc(strlen(str)+1);
 		strcpy(op->str, str);
 	}
 	op->flags = flags;
+	op->pool = b;
 	op->numargs = numargs;
+	op->cancelgen = q ? sqlasync_cancelgen(q) : 0;
+	if(q && sqlasync_timespec_isset(q->timeout)) {
+		clock_gettime(CLOCK_MONOTONIC, &op->deadline);
+		op->deadline = sqlasync_timespec_add(op->deadline, q->timeout);
+	} else
+		memset(&op->deadline, 0, sizeof(op->deadline));
+	if(s->instrumented)
+		clock_gettime(CLOCK_MONOTONIC, &op->queued);
 	return op;
 }
 
 
-static void sqlasync_op_free(sqlasync_op_t *op) {
+/* Returns an operation to the pool. Called from the database thread, and
+ * from the submitting thread when a query has been served from the cache;
+ * see the `pool' field for why that is safe. */
+static void sqlasync_op_free(sqlasync_t *s, sqlasync_op_t *op) {
 	if(!op)
 		return;
-	if(op->str && !(op->flags & SQLASYNC_STATIC))
+	if(op->str && (sqlasync_bufmanage(op->flags) == SQLASYNC_COPY || sqlasync_bufmanage(op->flags) == SQLASYNC_FREE))
 		free(op->str);
 	while(op->numargs > 0)
 		if(op->args[--op->numargs].freeptr)
 			free(op->args[op->numargs].val.ptr);
-	free(op);
+
+	unsigned int b = op->pool;
+	if(b >= SQLASYNC_POOL_BUCKETS || __atomic_load_n(&s->poolnum[b], __ATOMIC_RELAXED) >= SQLASYNC_POOL_MAX) {
+		free(op);
+		return;
+	}
+	__atomic_add_fetch(&s->poolnum[b], 1, __ATOMIC_RELAXED);
+	op->next = __atomic_load_n(&s->pool[b], __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&s->pool[b], &op->next, op, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
 }
 
 
 
 
-#define sqlasync_havetranstimeout(s) ((s)->transtimeout.tv_sec != 0 || (s)->transtimeout.tv_nsec != 0)
+/* Adds a list of operations, linked in FIFO order from f to l, to the
+ * submission stack. The list is pushed with a single compare-and-swap, so a
+ * NEXT chain can't be interleaved with operations from other threads. The
+ * first operation determines the lane of the entire list. */
+static void sqlasync_submit(sqlasync_t *s, sqlasync_op_t *f, sqlasync_op_t *l) {
+	sqlasync_op_t **stack = &s->submitted[!!(f->flags & SQLASYNC_PRIO)];
 
-static inline struct timespec sqlasync_timespec_add(struct timespec a, struct timespec b) {
-	a.tv_sec += b.tv_sec;
-	a.tv_nsec += b.tv_nsec;
-	if(a.tv_nsec > 1000000000) {
-		a.tv_sec++;
-		a.tv_nsec -= 1000000000;
+	/* The stack is in LIFO order, so reverse the list first. */
+	sqlasync_op_t *op = f, *prev = NULL, *next;
+	l->next = NULL;
+	while(op) {
+		next = op->next;
+		op->next = prev;
+		prev = op;
+		op = next;
 	}
-	return a;
-}
 
+	f->next = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(stack, &f->next, l, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
 
+	/* Both this and the database thread use sequentially consistent
+	 * operations, so either we see that the database thread is sleeping, or
+	 * the database thread sees our operation before it goes to sleep. */
+	if(__atomic_load_n(&s->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&s->waitlock);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->waitlock);
+	}
+}
 
 
-/* This function will "consume" arguments from the op struct. i.e. by taking
- * ownership of string/blob buffers and resetting their `freeptr' value. As
- * such, the argument list of the operation should be considered invalid after
- * calling this function. */
-static void sqlasync_thread_bind(sqlasync_op_t *op, sqlite3_stmt *st) {
-	unsigned short i;
-	for(i=1; i<=op->numargs; i++) {
-		sqlasync_value_t *v = op->args+(i-1);
+/* This function will "consume" the given arguments. i.e. by taking ownership
+ * of string/blob buffers and resetting their `freeptr' value. As such, the
+ * argument list of the operation should be considered invalid after calling
+ * this function. */
+static void sqlasync_thread_bind(sqlasync_value_t *args, unsigned int numargs, sqlite3_stmt *st) {
+	unsigned int i;
+	for(i=1; i<=numargs; i++) {
+		sqlasync_value_t *v = args+(i-1);
 		switch(v->type) {
 		case SQLITE_NULL:
 			sqlite3_bind_null(st, i);
@@ -484,139 +1124,1180 @@ static void sqlasync_thread_bind(sqlasync_op_t *op, sqlite3_stmt *st) {
 }
 
 
-/* Creates a result object from the current statement handler and sends it to
- * the queue. */
-static void sqlasync_thread_row(sqlasync_queue_t *q, sqlite3_stmt *st) {
-	sqlasync_result_t *r = sqlasync_result_create(SQLITE_ROW, 0, sqlite3_column_count(st));
+/* Serializes a query and its bind values into a cache key. Returns a
+ * malloc()ed buffer. */
+static char *sqlasync_cache_key(const char *query, const sqlasync_value_t *args, unsigned int numargs, size_t *len) {
+	size_t qlen = strlen(query)+1, size = qlen;
 	unsigned int i;
-	for(i=0; i<r->numcol; i++) {
-		sqlasync_value_t *c = r->col+i;
-		switch(sqlite3_column_type(st, i)) {
-		case SQLITE_NULL:
-			*c = sqlasync_null();
-			break;
-		case SQLITE_INTEGER:
-			*c = sqlasync_int(sqlite3_column_int64(st, i));
-			break;
-		case SQLITE_FLOAT:
-			*c = sqlasync_float(sqlite3_column_double(st, i));
-			break;
+	for(i=0; i<numargs; i++)
+		size += 1 + (args[i].type == SQLITE3_TEXT ? strlen(args[i].val.ptr)+1 :
+				args[i].type == SQLITE_BLOB ? sizeof(unsigned int)+args[i].length :
+				args[i].type == SQLITE_NULL ? 0 : 8);
+
+	char *key = malloc(size), *k = key;
+	memcpy(k, query, qlen);
+	k += qlen;
+	for(i=0; i<numargs; i++) {
+		const sqlasync_value_t *v = args+i;
+		*(k++) = v->type;
+		switch(v->type) {
+		case SQLITE_INTEGER: memcpy(k, &v->val.i64, 8); k += 8; break;
+		case SQLITE_FLOAT:   memcpy(k, &v->val.dbl, 8); k += 8; break;
 		case SQLITE3_TEXT:
-			*c = sqlasync_text(SQLASYNC_COPY, (char *)sqlite3_column_text(st, i));
+			memcpy(k, v->val.ptr, strlen(v->val.ptr)+1);
+			k += strlen(v->val.ptr)+1;
 			break;
 		case SQLITE_BLOB:
-			*c = sqlasync_blob(SQLASYNC_COPY, sqlite3_column_bytes(st, i), sqlite3_column_blob(st, i));
+			memcpy(k, &v->length, sizeof(unsigned int));
+			k += sizeof(unsigned int);
+			/* A NULL buffer is a zeroblob */
+			if(v->val.ptr)
+				memcpy(k, v->val.ptr, v->length);
+			else
+				memset(k, 0, v->length);
+			k += v->length;
 			break;
-		default:
-			assert("Invalid type returned by sqlite3_column_type()");
 		}
 	}
-	sqlasync_queue_result(q, r);
+	*len = size;
+	return key;
 }
 
 
-/* It is assumed that we aren't in a transaction when this function is called.
- * It then shouldn't be able to fail, either. */
-static void sqlasync_thread_begin(sqlasync_t *s) {
-	if(!s->begin)
-		assert(sqlite3_prepare_v2(s->db, "BEGIN", -1, &s->begin, NULL) == SQLITE_OK);
-	sqlite3_step(s->begin);
-	sqlite3_reset(s->begin);
-	s->intrans = 1;
+static unsigned int sqlasync_cache_hash(const char *key, size_t len) {
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+	while(len-- > 0)
+		h = (h ^ (unsigned char)*(key++)) * 16777619u;
+	return h;
 }
 
 
-/* Failure is ignored. In either case the current transaction is aborted. */
-static void sqlasync_thread_rollback(sqlasync_t *s) {
-	if(!s->rollback)
-		assert(sqlite3_prepare_v2(s->db, "ROLLBACK", -1, &s->rollback, NULL) == SQLITE_OK);
-	sqlite3_step(s->rollback);
-	sqlite3_reset(s->rollback);
-	s->intrans = 0;
+/* Copies a result, returns the number of bytes of memory used by the copy */
+static size_t sqlasync_result_dup(const sqlasync_result_t *r, sqlasync_result_t **dup) {
+	size_t mem = offsetof(sqlasync_result_t, col) + r->numcol*sizeof(sqlasync_value_t);
+	unsigned int i;
+	*dup = sqlasync_result_create(r->result, r->last, r->numcol);
+	for(i=0; i<r->numcol; i++) {
+		const sqlasync_value_t *v = r->col+i;
+		if(v->type == SQLITE3_TEXT && v->val.ptr) {
+			(*dup)->col[i] = sqlasync_text(SQLASYNC_COPY, v->val.ptr);
+			mem += strlen(v->val.ptr)+1;
+		} else if(v->type == SQLITE_BLOB && v->val.ptr) {
+			(*dup)->col[i] = sqlasync_blob(SQLASYNC_COPY, v->length, v->val.ptr);
+			mem += v->length;
+		} else {
+			(*dup)->col[i] = *v;
+			(*dup)->col[i].freeptr = 0;
+		}
+	}
+	(*dup)->next = NULL;
+	return mem;
 }
 
 
-/* Tries to do a commit. If it failed (r != SQLITE_OK), then a rollback is done
- * instead. */
-static int sqlasync_thread_commit(sqlasync_t *s) {
-	int r;
-	if(!s->commit)
-		assert(sqlite3_prepare_v2(s->db, "COMMIT", -1, &s->commit, NULL) == SQLITE_OK);
-	while((r = sqlite3_step(s->commit)) == SQLITE_BUSY)
-		;
-	sqlite3_reset(s->commit);
-	if(r != SQLITE_DONE)
-		sqlasync_thread_rollback(s);
-	s->intrans = 0;
-	return r;
+static void sqlasync_cache_unlink(sqlasync_t *s, sqlasync_centry_t *e) {
+	sqlasync_centry_t **p = &s->cache[e->hash % SQLASYNC_CACHE_BUCKETS];
+	while(*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	if(e->lprev)
+		e->lprev->lnext = e->lnext;
+	else
+		s->lrufirst = e->lnext;
+	if(e->lnext)
+		e->lnext->lprev = e->lprev;
+	else
+		s->lrulast = e->lprev;
+	s->cachemem -= e->mem;
 }
 
 
-/* Prepares, binds, and executes a query and sends back query results. Doesn't
- * send the `last' status result. Returns SQLITE_DONE on success. If st ==
- * NULL, then this was either a empty query, or one that failed validation.
- * Such queries have no effect on the state of the current transaction. */
-static int sqlasync_thread_exec(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt **st) {
-	int r;
+static void sqlasync_cache_free(sqlasync_centry_t *e) {
+	while(e->res) {
+		sqlasync_result_t *r = e->res;
+		e->res = r->next;
+		sqlasync_result_free(r);
+	}
+	free(e->tables);
+	free(e);
+}
 
-	/* COMPAT: sqlite3_prepare_v2() was added in SQLite 3.3.9 (2007-01-04) */
-	if((r = sqlite3_prepare_v2(s->db, op->str, -1, st, NULL)) != SQLITE_OK) {
-		if(*st)
-			sqlite3_finalize(*st);
-		return r;
+
+/* Passes back a copy of the cached results for a query, if there are any.
+ * Called from the submitting thread. */
+static int sqlasync_cache_get(sqlasync_t *s, sqlasync_queue_t *q, const sqlasync_op_t *op) {
+	size_t len;
+	char *key = sqlasync_cache_key(op->str, op->args, op->numargs, &len);
+	unsigned int hash = sqlasync_cache_hash(key, len);
+	sqlasync_result_t *first = NULL, **last = &first, *r;
+
+	pthread_mutex_lock(&s->cachelock);
+	sqlasync_centry_t *e = s->cache[hash % SQLASYNC_CACHE_BUCKETS];
+	while(e && (e->hash != hash || e->keylen != len || memcmp(e->key, key, len) != 0))
+		e = e->next;
+	if(e) {
+		for(r=e->res; r; r=r->next) {
+			sqlasync_result_dup(r, last);
+			last = &(*last)->next;
+		}
+		/* Move to the front of the LRU list */
+		if(e->lprev) {
+			e->lprev->lnext = e->lnext;
+			if(e->lnext)
+				e->lnext->lprev = e->lprev;
+			else
+				s->lrulast = e->lprev;
+			e->lprev = NULL;
+			e->lnext = s->lrufirst;
+			s->lrufirst->lprev = e;
+			s->lrufirst = e;
+		}
+	}
+	pthread_mutex_unlock(&s->cachelock);
+	free(key);
+
+	pthread_mutex_lock(&s->statslock);
+	if(e)
+		s->stats.cache_hits++;
+	else
+		s->stats.cache_misses++;
+	pthread_mutex_unlock(&s->statslock);
+
+	while(first) {
+		r = first;
+		first = r->next;
+		r->next = NULL;
+		sqlasync_queue_result(q, r);
 	}
+	return !!e;
+}
 
-	/* We have an "empty" query, let's just behave as if it didn't return
-	 * anything.
-	 * TODO: Return more information, so that the application can differentiate
-	 * between an empty query and a query that simply doesn't return anything?
-	 * */
-	if(!*st)
-		return SQLITE_DONE;
 
-	sqlasync_thread_bind(op, *st);
+/* Adds a table name to a list of zero-terminated names, if it's not in there
+ * already. */
+static void sqlasync_tables_add(char **list, size_t *len, const char *name) {
+	size_t i, n = strlen(name)+1;
+	for(i=0; i<*len; i+=strlen(*list+i)+1)
+		if(strcmp(*list+i, name) == 0)
+			return;
+	*list = realloc(*list, *len+n);
+	memcpy(*list+*len, name, n);
+	*len += n;
+}
 
-	r = SQLITE_ROW;
-	while(r == SQLITE_ROW) {
-		/* If we get an SQLITE_BUSY outside of a transaction, then we should
-		 * just retry. If we're inside a transaction, then BUSY is an error. */
-		if(s->intrans)
-			r = sqlite3_step(*st);
-		else
-			while((r = sqlite3_step(*st)) == SQLITE_BUSY)
-				;
 
-		if(r == SQLITE_ROW)
-			sqlasync_thread_row(op->q, *st);
-	}
-	return r;
+/* Whether the table is in the list. Table names are case-insensitive. */
+static int sqlasync_tables_match(const char *list, size_t len, const char *name) {
+	size_t i;
+	for(i=0; i<len; i+=strlen(list+i)+1)
+		if(sqlite3_stricmp(list+i, name) == 0)
+			return 1;
+	return 0;
 }
 
 
-/* Send back the `last' status. If the code isn't SQLITE_OK or SQLITE_DONE, an
- * error message will be included. */
-static void sqlasync_thread_final(sqlasync_t *s, sqlasync_op_t *op, int r) {
-	int okay = r == SQLITE_OK || r == SQLITE_DONE;
+static int sqlasync_tables_intersect(const char *a, size_t alen, const char *b, size_t blen) {
+	size_t i, j;
+	for(i=0; i<alen; i+=strlen(a+i)+1)
+		for(j=0; j<blen; j+=strlen(b+j)+1)
+			if(strcmp(a+i, b+j) == 0)
+				return 1;
+	return 0;
+}
+
+
+/* Authorizer, used to find out which tables are read by a query that is
+ * being captured. */
+static int sqlasync_thread_authorizer(void *dat, int action, const char *a1, const char *a2, const char *db, const char *trigger) {
+	sqlasync_t *s = dat;
+	if(s->capturing && action == SQLITE_READ && a1)
+		sqlasync_tables_add(&s->captables, &s->captableslen, a1);
+	return SQLITE_OK;
+}
+
+
+/* Forget the changes logged after the given position */
+static void sqlasync_thread_cdc_truncate(sqlasync_t *s, size_t mark) {
+	if(mark < s->cdclen) {
+		s->cdcnameslen = s->cdc[mark].name;
+		s->cdclen = mark;
+	}
+}
+
+
+/* Update hook, records which tables have been modified by the current
+ * operation, and logs the change for subscribers. */
+static void sqlasync_thread_update(void *dat, int action, const char *db, const char *table, sqlite3_int64 rowid) {
+	sqlasync_t *s = dat;
+	if(s->cachemax)
+		sqlasync_tables_add(&s->dirty, &s->dirtylen, table);
+	if(!s->subs)
+		return;
+
+	size_t n = strlen(table)+1;
+	if(s->cdclen == s->cdcsize) {
+		s->cdcsize = s->cdcsize ? s->cdcsize*2 : 64;
+		s->cdc = realloc(s->cdc, s->cdcsize*sizeof(*s->cdc));
+	}
+	if(s->cdcnameslen + n > s->cdcnamessize) {
+		while(s->cdcnameslen + n > s->cdcnamessize)
+			s->cdcnamessize = s->cdcnamessize ? s->cdcnamessize*2 : 1024;
+		s->cdcnames = realloc(s->cdcnames, s->cdcnamessize);
+	}
+	sqlasync_change_t *c = s->cdc + s->cdclen++;
+	c->op = action;
+	c->rowid = rowid;
+	c->name = s->cdcnameslen;
+	memcpy(s->cdcnames+s->cdcnameslen, table, n);
+	s->cdcnameslen += n;
+}
+
+
+/* Commit hook. The commit may still fail after this, the log is only passed
+ * on once the connection is back in autocommit mode. */
+static int sqlasync_thread_commithook(void *dat) {
+	sqlasync_t *s = dat;
+	s->cdccommit = 1;
+	s->persist.dirty = 1;
+	s->ckptdirty = !!s->ckptdb;
+	return 0;
+}
+
+
+static void sqlasync_thread_rollbackhook(void *dat) {
+	sqlasync_t *s = dat;
+	size_t i;
+	sqlasync_thread_cdc_truncate(s, 0);
+	for(i=0; i<s->cdcsplen; i++)
+		free(s->cdcsp[i].name);
+	s->cdcsplen = 0;
+	s->cdccommit = 0;
+}
+
+
+/* Removes all cache entries (if tables == NULL) or those that have read any
+ * of the given tables. */
+static void sqlasync_thread_cache_remove(sqlasync_t *s, const char *tables, size_t tableslen) {
+	sqlasync_centry_t *e, *next;
+	unsigned int n = 0;
+	pthread_mutex_lock(&s->cachelock);
+	for(e=s->lrufirst; e; e=next) {
+		next = e->lnext;
+		if(!tables || sqlasync_tables_intersect(e->tables, e->tableslen, tables, tableslen)) {
+			sqlasync_cache_unlink(s, e);
+			sqlasync_cache_free(e);
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&s->cachelock);
+
+	if(n) {
+		pthread_mutex_lock(&s->statslock);
+		s->stats.cache_invalidations += n;
+		pthread_mutex_unlock(&s->statslock);
+	}
+}
+
+
+/* Invalidates the cache entries affected by the statement that has just been
+ * executed. A statement that isn't read-only without modifying any rows is
+ * assumed to have changed the schema (or to have used the truncate
+ * optimization, which bypasses the update hook), so that clears the entire
+ * cache. */
+static void sqlasync_thread_invalidate(sqlasync_t *s, sqlite3_stmt *st) {
+	if(!s->cachemax)
+		return;
+	if(s->dirtylen)
+		sqlasync_thread_cache_remove(s, s->dirty, s->dirtylen);
+	else if(st && !sqlite3_stmt_readonly(st))
+		sqlasync_thread_cache_remove(s, NULL, 0);
+	s->dirtylen = 0;
+}
+
+
+static void sqlasync_thread_capture_start(sqlasync_t *s, sqlasync_op_t *op) {
+	s->capturing = 1;
+	s->capkey = sqlasync_cache_key(op->str, op->args, op->numargs, &s->capkeylen);
+	s->capmem = s->captableslen = 0;
+}
+
+
+static void sqlasync_thread_capture(sqlasync_t *s, const sqlasync_result_t *r) {
+	sqlasync_result_t *dup;
+	s->capmem += sqlasync_result_dup(r, &dup);
+	queue_push(&s->capres, dup, dup);
+	/* Don't let a single result set take up more than a quarter of the cache */
+	if(s->capmem > s->cachemax/4)
+		s->capturing = 0;
+}
+
+
+/* Adds the captured results to the cache if the query was successful, and
+ * frees the capture state. */
+static void sqlasync_thread_capture_end(sqlasync_t *s, sqlite3_stmt *st, int r) {
+	if(s->capturing && r == SQLITE_DONE && st && sqlite3_stmt_readonly(st) && !s->dirtylen) {
+		sqlasync_centry_t *e = malloc(offsetof(sqlasync_centry_t, key) + s->capkeylen);
+		sqlasync_result_t *done = sqlasync_result_create(SQLITE_DONE, 1, 0);
+		queue_push(&s->capres, done, done);
+		e->res = s->capres.first;
+		e->tables = s->captables;
+		e->tableslen = s->captableslen;
+		e->keylen = s->capkeylen;
+		e->hash = sqlasync_cache_hash(s->capkey, s->capkeylen);
+		e->mem = offsetof(sqlasync_centry_t, key) + s->capkeylen + s->captableslen + s->capmem + offsetof(sqlasync_result_t, col);
+		memcpy(e->key, s->capkey, s->capkeylen);
+		s->capres.first = s->capres.last = NULL;
+		s->captables = NULL;
+
+		unsigned int evicted = 0;
+		pthread_mutex_lock(&s->cachelock);
+		/* Replace any existing entry with the same key */
+		sqlasync_centry_t *o = s->cache[e->hash % SQLASYNC_CACHE_BUCKETS];
+		while(o && (o->hash != e->hash || o->keylen != e->keylen || memcmp(o->key, e->key, e->keylen) != 0))
+			o = o->next;
+		if(o) {
+			sqlasync_cache_unlink(s, o);
+			sqlasync_cache_free(o);
+		}
+		while(s->lrulast && s->cachemem + e->mem > s->cachemax) {
+			o = s->lrulast;
+			sqlasync_cache_unlink(s, o);
+			sqlasync_cache_free(o);
+			evicted++;
+		}
+		e->next = s->cache[e->hash % SQLASYNC_CACHE_BUCKETS];
+		s->cache[e->hash % SQLASYNC_CACHE_BUCKETS] = e;
+		e->lprev = NULL;
+		e->lnext = s->lrufirst;
+		if(s->lrufirst)
+			s->lrufirst->lprev = e;
+		else
+			s->lrulast = e;
+		s->lrufirst = e;
+		s->cachemem += e->mem;
+		pthread_mutex_unlock(&s->cachelock);
+
+		if(evicted) {
+			pthread_mutex_lock(&s->statslock);
+			s->stats.cache_evictions += evicted;
+			pthread_mutex_unlock(&s->statslock);
+		}
+	}
+
+	while(s->capres.first) {
+		sqlasync_result_t *res = s->capres.first;
+		queue_pop(&s->capres);
+		sqlasync_result_free(res);
+	}
+	free(s->capkey);
+	s->capkey = NULL;
+	s->capturing = 0;
+}
+
+
+static void sqlasync_thread_hold(sqlasync_t *s, sqlasync_queue_t *q, sqlasync_result_t *res, int durable) {
+	sqlasync_held_t *h = malloc(sizeof(sqlasync_held_t));
+	h->q = q;
+	h->res = res;
+	h->durable = durable;
+	queue_push(&s->held, h, h);
+}
+
+
+/* Passes a result of an operation to its queue. If a result for the same
+ * queue is being held, this one is held as well, so that the results on a
+ * queue remain in the order of the operations. */
+static void sqlasync_thread_result(sqlasync_t *s, sqlasync_queue_t *q, sqlasync_result_t *res) {
+	sqlasync_held_t *h;
+	for(h=q ? s->held.first : NULL; h; h=h->next)
+		if(h->q == q) {
+			sqlasync_thread_hold(s, q, res, 0);
+			return;
+		}
+	sqlasync_queue_result(q, res);
+}
+
+
+/* Creates a result object from the current statement handler and sends it to
+ * the queue. */
+static void sqlasync_thread_row(sqlasync_t *s, sqlasync_queue_t *q, sqlite3_stmt *st) {
+	sqlasync_result_t *r = sqlasync_result_create(SQLITE_ROW, 0, sqlite3_column_count(st));
+	unsigned int i;
+	for(i=0; i<r->numcol; i++) {
+		sqlasync_value_t *c = r->col+i;
+		switch(sqlite3_column_type(st, i)) {
+		case SQLITE_NULL:
+			*c = sqlasync_null();
+			break;
+		case SQLITE_INTEGER:
+			*c = sqlasync_int(sqlite3_column_int64(st, i));
+			break;
+		case SQLITE_FLOAT:
+			*c = sqlasync_float(sqlite3_column_double(st, i));
+			break;
+		case SQLITE3_TEXT:
+			*c = sqlasync_text(SQLASYNC_COPY, (char *)sqlite3_column_text(st, i));
+			break;
+		case SQLITE_BLOB:
+			*c = sqlasync_blob(SQLASYNC_COPY, sqlite3_column_bytes(st, i), sqlite3_column_blob(st, i));
+			break;
+		default:
+			assert("Invalid type returned by sqlite3_column_type()");
+		}
+	}
+	if(s->capturing)
+		sqlasync_thread_capture(s, r);
+	sqlasync_thread_result(s, q, r);
+}
+
+
+/* Returns whether the current operation should be aborted, and sets
+ * s->abortmsg if so. */
+static int sqlasync_thread_aborted(sqlasync_t *s) {
+	sqlasync_op_t *op = s->curop;
+	if(s->abortmsg)
+		return 1;
+	if(!op)
+		return 0;
+	if(op->q && sqlasync_cancelgen(op->q) != op->cancelgen)
+		s->abortmsg = "Query has been cancelled";
+	else if(sqlasync_timespec_isset(op->deadline) && sqlasync_timespec_passed(&op->deadline)) {
+		s->abortmsg = "Query deadline exceeded";
+		pthread_mutex_lock(&s->statslock);
+		s->stats.expired++;
+		pthread_mutex_unlock(&s->statslock);
+	}
+	return !!s->abortmsg;
+}
+
+
+/* Progress handler, aborts the running statement when its operation has been
+ * cancelled or its deadline has passed. */
+static int sqlasync_thread_progress(void *dat) {
+	return sqlasync_thread_aborted(dat);
+}
+
+
+/* SQLite busy handler. Waits with an exponential backoff between busymin and
+ * busymax, with jitter to avoid retrying in lockstep with other processes,
+ * and gives up when the total wait exceeds busytimeout. */
+static int sqlasync_thread_busy(void *dat, int count) {
+	sqlasync_t *s = dat;
+	if(sqlasync_thread_aborted(s))
+		return 0;
+	if(!count) {
+		clock_gettime(CLOCK_MONOTONIC, &s->busystart);
+		s->busynext = s->busymin;
+	}
+
+	unsigned int elapsed = sqlasync_elapsed_us(&s->busystart) / 1000;
+	if(s->busytimeout && elapsed >= s->busytimeout) {
+		pthread_mutex_lock(&s->statslock);
+		s->stats.busy_timeouts++;
+		pthread_mutex_unlock(&s->statslock);
+		return 0;
+	}
+
+	/* Wait somewhere between half and the full backoff time */
+	unsigned int wait = s->busynext/2 + rand_r(&s->busyseed) % (s->busynext/2 + 1);
+	if(s->busytimeout && wait > s->busytimeout - elapsed)
+		wait = s->busytimeout - elapsed;
+	s->busynext = s->busynext*2 > s->busymax ? s->busymax : s->busynext*2;
+
+	struct timespec ts = { wait / 1000, (wait % 1000) * 1000000 }, start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nanosleep(&ts, NULL);
+
+	pthread_mutex_lock(&s->statslock);
+	s->stats.busy_retries++;
+	s->stats.busy_wait += sqlasync_elapsed_us(&start);
+	pthread_mutex_unlock(&s->statslock);
+	return 1;
+}
+
+
+/* It is assumed that we aren't in a transaction when this function is called.
+ * It then shouldn't be able to fail, either. */
+static void sqlasync_thread_begin(sqlasync_t *s) {
+	if(!s->begin)
+		assert(sqlite3_prepare_v2(s->db, "BEGIN", -1, &s->begin, NULL) == SQLITE_OK);
+	sqlite3_step(s->begin);
+	sqlite3_reset(s->begin);
+	clock_gettime(CLOCK_MONOTONIC, &s->transstart);
+	s->intrans = 1;
+}
+
+
+/* Replaces the held results of SQLASYNC_DURABLE queries after `mark', or all
+ * of them if mark is NULL, with an error result. They remain held, there may
+ * be earlier results for the same queue that have to be passed back first. */
+static void sqlasync_thread_held_fail(sqlasync_t *s, sqlasync_held_t *mark, int r, const char *msg) {
+	sqlasync_held_t *h;
+	for(h = mark ? mark->next : s->held.first; h; h=h->next)
+		if(h->durable) {
+			sqlasync_result_free(h->res);
+			h->res = sqlasync_result_create(r, 1, 1);
+			h->res->col[0] = sqlasync_text(SQLASYNC_COPY, msg);
+			h->durable = 0;
+		}
+}
+
+
+/* Passes back all held results. If the modifications have not been
+ * committed, r indicates the error and the results of SQLASYNC_DURABLE
+ * queries are replaced by an error result. */
+static void sqlasync_thread_release(sqlasync_t *s, int r, const char *msg) {
+	sqlasync_held_t *h = s->held.first, *next;
+	if(r != SQLITE_DONE)
+		sqlasync_thread_held_fail(s, NULL, r, msg);
+	s->held.first = s->held.last = NULL;
+	for(; h; h=next) {
+		next = h->next;
+		sqlasync_queue_result(h->q, h->res);
+		free(h);
+	}
+}
+
+
+/* Failure is ignored. In either case the current transaction is aborted. */
+static void sqlasync_thread_rollback(sqlasync_t *s) {
+	sqlasync_thread_release(s, SQLITE_ABORT, "Transaction has been rolled back");
+	/* The cache may hold results that have been read within the transaction */
+	if(s->cachemax)
+		sqlasync_thread_cache_remove(s, NULL, 0);
+	if(!s->rollback)
+		assert(sqlite3_prepare_v2(s->db, "ROLLBACK", -1, &s->rollback, NULL) == SQLITE_OK);
+	sqlite3_step(s->rollback);
+	sqlite3_reset(s->rollback);
+	s->intrans = 0;
+	s->insavepoint = 0;
+	s->transops = s->transbytes = 0;
+}
+
+
+/* Tries to do a commit. If it failed (r != SQLITE_OK), then a rollback is done
+ * instead. */
+static int sqlasync_thread_commit(sqlasync_t *s) {
+	int r;
+	if(!s->commit)
+		assert(sqlite3_prepare_v2(s->db, "COMMIT", -1, &s->commit, NULL) == SQLITE_OK);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = sqlite3_step(s->commit);
+	sqlite3_reset(s->commit);
+	unsigned long long commit = sqlasync_elapsed_us(&start);
+	unsigned long long exec = sqlasync_elapsed_us(&s->transstart) - commit;
+
+	pthread_mutex_lock(&s->statslock);
+	s->stats.commits++;
+	s->stats.commit_time += commit;
+	pthread_mutex_unlock(&s->statslock);
+
+	/* Adaptive group commit: Grow the group if committing takes more time
+	 * than executing the queries, shrink it if committing is cheap in order
+	 * to reduce the time until modifications are durable. */
+	if((s->groupflags & SQLASYNC_GROUP_ADAPTIVE) && s->transops >= s->groupops) {
+		if(commit > exec)
+			s->groupops = s->groupops > s->groupmaxops/2 ? s->groupmaxops : s->groupops*2;
+		else if(commit < exec/4 && s->groupops > 1)
+			s->groupops /= 2;
+	}
+
+	sqlasync_thread_release(s, r, sqlite3_errmsg(s->db));
+	if(r != SQLITE_DONE)
+		sqlasync_thread_rollback(s);
+	s->intrans = 0;
+	s->insavepoint = 0;
+	s->transops = s->transbytes = 0;
+	return r;
+}
+
+
+/* Commit a transaction that isn't associated with a single query, errors are
+ * reported on the queue given to sqlasync_open(). */
+static void sqlasync_thread_groupcommit(sqlasync_t *s) {
+	int r = sqlasync_thread_commit(s);
+	if(r != SQLITE_DONE) {
+		sqlasync_result_t *res = sqlasync_result_create(r, 0, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->db));
+		sqlasync_queue_result(s->dbqueue, res);
+	}
+}
+
+
+/* Within a grouped transaction, each query or NEXT chain is executed in a
+ * savepoint, so that an error only undoes the modifications of that query.
+ * COMPAT: SAVEPOINT was added in SQLite 3.6.8 (2009-01-12) */
+static void sqlasync_thread_savepoint(sqlasync_t *s) {
+	if(!s->savepoint)
+		assert(sqlite3_prepare_v2(s->db, "SAVEPOINT sqlasync", -1, &s->savepoint, NULL) == SQLITE_OK);
+	sqlite3_step(s->savepoint);
+	sqlite3_reset(s->savepoint);
+	s->savepointheld = s->held.last;
+	s->cdcmark = s->cdclen;
+	s->insavepoint = 1;
+}
+
+
+/* Releases the current savepoint, after rolling back to it if `rollback' is
+ * set. The transaction itself remains active. */
+static void sqlasync_thread_savepoint_end(sqlasync_t *s, int rollback) {
+	if(rollback) {
+		if(!s->rollbackto)
+			assert(sqlite3_prepare_v2(s->db, "ROLLBACK TO sqlasync", -1, &s->rollbackto, NULL) == SQLITE_OK);
+		sqlite3_step(s->rollbackto);
+		sqlite3_reset(s->rollbackto);
+		sqlasync_thread_cdc_truncate(s, s->cdcmark);
+		sqlasync_thread_held_fail(s, s->savepointheld, SQLITE_ABORT, "Transaction has been rolled back");
+		if(s->cachemax)
+			sqlasync_thread_cache_remove(s, NULL, 0);
+	}
+	if(!s->release)
+		assert(sqlite3_prepare_v2(s->db, "RELEASE sqlasync", -1, &s->release, NULL) == SQLITE_OK);
+	sqlite3_step(s->release);
+	sqlite3_reset(s->release);
+	s->insavepoint = 0;
+}
+
+
+/* Steps through a prepared and bound statement and sends back the resulting
+ * rows. Returns the result of the last sqlite3_step(). */
+static int sqlasync_thread_step(sqlasync_t *s, sqlasync_queue_t *q, sqlite3_stmt *st) {
+	/* Waiting on SQLITE_BUSY is handled by sqlasync_thread_busy(), so if we
+	 * get it here, we've already given up. */
+	int r;
+	while((r = sqlite3_step(st)) == SQLITE_ROW) {
+		s->oprows++;
+		sqlasync_thread_row(s, q, st);
+	}
+	return r;
+}
+
+
+/* Executes a SQLASYNC_MANY statement once for each row of bind values. A row
+ * that fails without aborting the transaction is reported as a separate
+ * (non-last) result and doesn't stop the other rows from being executed. If
+ * the transaction has been aborted, the error is returned immediately. */
+static int sqlasync_thread_many(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt *st) {
+	unsigned int i, nrows = op->args[0].val.i64;
+	unsigned int ncols = nrows ? (op->numargs-1) / nrows : 0;
+	int r;
+
+	for(i=0; i<nrows; i++) {
+		if(i)
+			sqlite3_reset(st);
+		sqlasync_thread_bind(op->args+1+(i*ncols), ncols, st);
+		if((r = sqlasync_thread_step(s, op->q, st)) == SQLITE_DONE)
+			continue;
+		if(sqlite3_get_autocommit(s->db))
+			return r;
+		sqlasync_result_t *res = sqlasync_result_create(r, 0, 2);
+		res->col[0] = sqlasync_int(i);
+		res->col[1] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->db));
+		sqlasync_thread_result(s, op->q, res);
+	}
+	return SQLITE_DONE;
+}
+
+
+/* Passes back a batch of decoded rows. Text fields hold an offset into `buf'
+ * while the batch is being filled, since the buffer may be moved when the
+ * string arena grows. */
+static void sqlasync_thread_batch(sqlasync_t *s, sqlasync_queue_t *q, const sqlasync_layout_t *l, char *buf, size_t len, unsigned int n) {
+	unsigned int i, f;
+	for(i=0; i<n; i++)
+		for(f=0; f<l->numfields; f++)
+			if(l->fields[f].type == SQLASYNC_FIELD_TEXT) {
+				char **p = (char **)(buf + i*l->size + l->fields[f].offset);
+				if(*p)
+					*p = buf + (size_t)*p;
+			}
+
+	sqlasync_result_t *r = sqlasync_result_create(SQLITE_ROW, 0, 2);
+	r->col[0] = sqlasync_blob(SQLASYNC_FREE, len, buf);
+	r->col[1] = sqlasync_int(n);
+	sqlasync_thread_result(s, q, r);
+}
+
+
+/* Steps through a SQLASYNC_LAYOUT statement */
+static int sqlasync_thread_step_layout(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt *st) {
+	const sqlasync_layout_t *l = op->args[0].val.ptr;
+	unsigned int batch = op->args[1].val.i64, n = 0, f;
+	size_t rows = batch * l->size, len = 0, size = 0;
+	char *buf = NULL;
+	int r;
+
+	while((r = sqlite3_step(st)) == SQLITE_ROW) {
+		s->oprows++;
+		if(!buf) {
+			size = rows + 1024;
+			buf = malloc(size);
+			len = rows;
+		}
+		char *row = buf + n*l->size;
+		memset(row, 0, l->size);
+		for(f=0; f<l->numfields; f++) {
+			const sqlasync_field_t *fl = l->fields+f;
+			switch(fl->type) {
+			case SQLASYNC_FIELD_INT64:
+				*(sqlite3_int64 *)(row+fl->offset) = sqlite3_column_int64(st, fl->col);
+				break;
+			case SQLASYNC_FIELD_INT:
+				*(int *)(row+fl->offset) = sqlite3_column_int(st, fl->col);
+				break;
+			case SQLASYNC_FIELD_DOUBLE:
+				*(double *)(row+fl->offset) = sqlite3_column_double(st, fl->col);
+				break;
+			case SQLASYNC_FIELD_TEXT: {
+				const char *t = (const char *)sqlite3_column_text(st, fl->col);
+				size_t tl = sqlite3_column_bytes(st, fl->col)+1;
+				if(!t)
+					break;
+				if(len + tl > size) {
+					while(len + tl > size)
+						size *= 2;
+					buf = realloc(buf, size);
+					row = buf + n*l->size;
+				}
+				memcpy(buf+len, t, tl);
+				/* The offset is never 0, since the strings come after the rows */
+				*(char **)(row+fl->offset) = (char *)len;
+				len += tl;
+				break;
+			}
+			}
+		}
+		if(++n == batch) {
+			sqlasync_thread_batch(s, op->q, l, buf, len, n);
+			buf = NULL;
+			n = 0;
+		}
+	}
+
+	if(n)
+		sqlasync_thread_batch(s, op->q, l, buf, len, n);
+	return r;
+}
+
+
+/* Copies the next word of an SQL statement into `buf', skipping whitespace,
+ * comments and quotes. Returns a pointer to the remainder of the statement. */
+static const char *sqlasync_sql_word(const char *sql, char *buf, size_t size) {
+	size_t n = 0;
+	while(1) {
+		if(*sql == ' ' || *sql == '\t' || *sql == '\n' || *sql == '\r' || *sql == '\f')
+			sql++;
+		else if(sql[0] == '-' && sql[1] == '-') {
+			while(*sql && *sql != '\n')
+				sql++;
+		} else if(sql[0] == '/' && sql[1] == '*') {
+			/* An unterminated comment runs to the end of the statement */
+			for(sql += 2; *sql && !(sql[0] == '*' && sql[1] == '/'); sql++)
+				;
+			if(*sql)
+				sql += 2;
+		} else
+			break;
+	}
+	if(*sql == '"' || *sql == '\'' || *sql == '`' || *sql == '[') {
+		char end = *sql == '[' ? ']' : *sql;
+		for(sql++; *sql && *sql != end; sql++)
+			if(n < size-1)
+				buf[n++] = *sql;
+		if(*sql)
+			sql++;
+	} else
+		for(; (*sql >= 'a' && *sql <= 'z') || (*sql >= 'A' && *sql <= 'Z') || (*sql >= '0' && *sql <= '9') || *sql == '_' || (*sql & 0x80); sql++)
+			if(n < size-1)
+				buf[n++] = *sql;
+	buf[n] = 0;
+	return sql;
+}
+
+
+/* Keeps track of the savepoints of the application, so that the changes
+ * undone by a ROLLBACK TO are removed from the change log. Called after each
+ * successful statement while there are subscribers. */
+static void sqlasync_thread_cdc_stmt(sqlasync_t *s, sqlite3_stmt *st) {
+	char w[64], name[64];
+	const char *sql = sqlite3_sql(st);
+	size_t i;
+	if(!sql)
+		return;
+	sql = sqlasync_sql_word(sql, w, sizeof(w));
+
+	if(sqlite3_stricmp(w, "SAVEPOINT") == 0) {
+		sqlasync_sql_word(sql, name, sizeof(name));
+		if(s->cdcsplen == s->cdcspsize) {
+			s->cdcspsize = s->cdcspsize ? s->cdcspsize*2 : 8;
+			s->cdcsp = realloc(s->cdcsp, s->cdcspsize*sizeof(*s->cdcsp));
+		}
+		s->cdcsp[s->cdcsplen].name = malloc(strlen(name)+1);
+		strcpy(s->cdcsp[s->cdcsplen].name, name);
+		s->cdcsp[s->cdcsplen++].mark = s->cdclen;
+		return;
+	}
+
+	int release = sqlite3_stricmp(w, "RELEASE") == 0;
+	if(!release && sqlite3_stricmp(w, "ROLLBACK") != 0)
+		return;
+	sql = sqlasync_sql_word(sql, name, sizeof(name));
+	if(!release) {
+		if(sqlite3_stricmp(name, "TRANSACTION") == 0)
+			sql = sqlasync_sql_word(sql, name, sizeof(name));
+		if(sqlite3_stricmp(name, "TO") != 0)
+			return; /* Handled by the rollback hook */
+		sql = sqlasync_sql_word(sql, name, sizeof(name));
+	}
+	if(sqlite3_stricmp(name, "SAVEPOINT") == 0)
+		sqlasync_sql_word(sql, name, sizeof(name));
+
+	for(i=s->cdcsplen; i>0; i--)
+		if(sqlite3_stricmp(s->cdcsp[i-1].name, name) == 0)
+			break;
+	if(!i)
+		return;
+	/* ROLLBACK TO keeps the savepoint itself, RELEASE removes it */
+	if(!release)
+		sqlasync_thread_cdc_truncate(s, s->cdcsp[i-1].mark);
+	else
+		i--;
+	while(s->cdcsplen > i)
+		free(s->cdcsp[--s->cdcsplen].name);
+}
+
+
+/* Passes the changes of a committed transaction to the subscribers */
+static void sqlasync_thread_cdc_flush(sqlasync_t *s) {
+	sqlasync_sub_t *sub;
+	size_t i, j, n;
+	s->cdccommit = 0;
+	/* The COMMIT failed, the changes remain pending */
+	if(!sqlite3_get_autocommit(s->db))
+		return;
+
+	for(sub=s->subs; sub; sub=sub->next) {
+		for(i=n=0; i<s->cdclen; i++)
+			if(!sub->tableslen || sqlasync_tables_match(sub->tables, sub->tableslen, s->cdcnames+s->cdc[i].name))
+				n++;
+		if(!n)
+			continue;
+		sqlasync_result_t *res = sqlasync_result_create(SQLITE_ROW, 0, 3*n);
+		for(i=j=0; i<s->cdclen; i++) {
+			const char *name = s->cdcnames+s->cdc[i].name;
+			if(sub->tableslen && !sqlasync_tables_match(sub->tables, sub->tableslen, name))
+				continue;
+			res->col[j++] = sqlasync_text(SQLASYNC_COPY, name);
+			res->col[j++] = sqlasync_int(s->cdc[i].op);
+			res->col[j++] = sqlasync_int(s->cdc[i].rowid);
+		}
+		sqlasync_queue_result(sub->q, res);
+	}
+
+	sqlasync_thread_cdc_truncate(s, 0);
+	while(s->cdcsplen > 0)
+		free(s->cdcsp[--s->cdcsplen].name);
+}
+
+
+static void sqlasync_thread_subscribe(sqlasync_t *s, sqlasync_op_t *op) {
+	unsigned int i;
+	if(!s->db) {
+		sqlasync_result_t *res = sqlasync_result_create(SQLITE_MISUSE, 1, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, "Database not open");
+		sqlasync_queue_result(op->q, res);
+		return;
+	}
+
+	sqlasync_sub_t *sub = calloc(1, sizeof(sqlasync_sub_t));
+	sub->q = op->q;
+	for(i=0; i<op->numargs; i++)
+		sqlasync_tables_add(&sub->tables, &sub->tableslen, op->args[i].val.ptr);
+	/* COMPAT: sqlite3_commit_hook() and sqlite3_rollback_hook() are
+	 * experimental in SQLite before 3.6.x, but have been around since 3.0 */
+	if(!s->subs) {
+		sqlite3_update_hook(s->db, sqlasync_thread_update, s);
+		sqlite3_commit_hook(s->db, sqlasync_thread_commithook, s);
+		sqlite3_rollback_hook(s->db, sqlasync_thread_rollbackhook, s);
+	}
+	sub->next = s->subs;
+	s->subs = sub;
+}
+
+
+/* Removes the subscription of the given queue, or all of them if q == NULL */
+static void sqlasync_thread_unsubscribe(sqlasync_t *s, sqlasync_queue_t *q) {
+	sqlasync_sub_t **p = &s->subs;
+	while(*p) {
+		sqlasync_sub_t *sub = *p;
+		if(q && sub->q != q) {
+			p = &sub->next;
+			continue;
+		}
+		*p = sub->next;
+		sqlasync_queue_result(sub->q, sqlasync_result_create(SQLITE_OK, 1, 0));
+		free(sub->tables);
+		free(sub);
+	}
+	if(!s->subs)
+		sqlasync_thread_rollbackhook(s);
+}
+
+
+/* Steps through a SQLASYNC_VISIT statement */
+static int sqlasync_thread_step_visit(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt *st) {
+	sqlasync_visit_func_t f = (sqlasync_visit_func_t)op->args[0].val.ptr;
+	void *data = op->args[1].val.ptr;
+	int r;
+
+	while((r = sqlite3_step(st)) == SQLITE_ROW) {
+		s->oprows++;
+		if(f(op->q, st, data)) {
+			r = SQLITE_DONE;
+			break;
+		}
+	}
+	if(r == SQLITE_DONE)
+		f(op->q, NULL, data);
+	return r;
+}
+
+
+/* Prepares, binds, and executes a query and sends back query results. Doesn't
+ * send the `last' status result. Returns SQLITE_DONE on success. If st ==
+ * NULL, then this was either a empty query, or one that failed validation.
+ * Such queries have no effect on the state of the current transaction. */
+static int sqlasync_thread_exec(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt **st) {
+	int r;
+
+	/* Don't touch the database at all if the query has already been
+	 * cancelled. */
+	s->curop = op;
+	if(sqlasync_thread_aborted(s))
+		return SQLITE_INTERRUPT;
+	size_t cdcmark = s->cdclen;
+
+	/* The tables read by a cached query are found while preparing it, so a
+	 * cached statement of an interned query can't be used. */
+	if((op->flags & SQLASYNC_CACHE) && s->cachemax && !(op->flags & (SQLASYNC_MANY|SQLASYNC_LAYOUT|SQLASYNC_VISIT)) &&
+			((op->flags & SQLASYNC_SINGLE) == 0 || (op->flags & SQLASYNC_SINGLE) == SQLASYNC_SINGLE))
+		sqlasync_thread_capture_start(s, op);
+
+	/* Interned queries keep their prepared statement around */
+	sqlasync_intern_t *in = sqlasync_bufmanage(op->flags) == SQLASYNC_INTERNED && !s->capturing ? sqlasync_intern_get(op->str) : NULL;
+	if(in && in->st)
+		*st = in->st;
+
+	/* COMPAT: sqlite3_prepare_v2() was added in SQLite 3.3.9 (2007-01-04) */
+	else if((r = sqlite3_prepare_v2(s->db, op->str, -1, st, NULL)) != SQLITE_OK) {
+		if(*st)
+			sqlite3_finalize(*st);
+		return r;
+	}
+
+	/* We have an "empty" query, let's just behave as if it didn't return
+	 * anything.
+	 * TODO: Return more information, so that the application can differentiate
+	 * between an empty query and a query that simply doesn't return anything?
+	 * */
+	if(!*st)
+		return SQLITE_DONE;
+	if(in)
+		in->st = *st;
+
+	if(op->flags & SQLASYNC_MANY)
+		r = sqlasync_thread_many(s, op, *st);
+	else if(op->flags & SQLASYNC_LAYOUT) {
+		sqlasync_thread_bind(op->args+2, op->numargs-2, *st);
+		r = sqlasync_thread_step_layout(s, op, *st);
+	} else if(op->flags & SQLASYNC_VISIT) {
+		sqlasync_thread_bind(op->args+2, op->numargs-2, *st);
+		r = sqlasync_thread_step_visit(s, op, *st);
+	} else {
+		sqlasync_thread_bind(op->args, op->numargs, *st);
+		r = sqlasync_thread_step(s, op->q, *st);
+	}
+	/* The busy handler may have given up because of the abort */
+	if(s->abortmsg && r != SQLITE_DONE)
+		r = SQLITE_INTERRUPT;
+
+	/* The changes of a failed statement are undone by SQLite, which doesn't
+	 * necessarily call the rollback hook: not when the transaction remains
+	 * active, and not when an autocommit statement is undone by its
+	 * statement journal. */
+	if(s->subs && r == SQLITE_DONE)
+		sqlasync_thread_cdc_stmt(s, *st);
+	else if(s->subs)
+		sqlasync_thread_cdc_truncate(s, cdcmark);
+	return r;
+}
+
+
+/* Send back the `last' status. If the code isn't SQLITE_OK or SQLITE_DONE, an
+ * error message will be included. */
+static void sqlasync_thread_final(sqlasync_t *s, sqlasync_op_t *op, int r) {
+	int okay = r == SQLITE_OK || r == SQLITE_DONE;
 	sqlasync_result_t *res = sqlasync_result_create(r, 1, okay ? 0 : 1);
 	if(!okay)
-		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->db));
-	sqlasync_queue_result(op->q, res);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, s->abortmsg ? s->abortmsg : sqlite3_errmsg(s->db));
+
+	/* Hold back the result until the transaction has been committed */
+	if(okay && s->intrans && op->q && (op->flags & SQLASYNC_DURABLE))
+		sqlasync_thread_hold(s, op->q, res, 1);
+	else
+		sqlasync_thread_result(s, op->q, res);
+}
+
+
+/* Returns the EXPLAIN QUERY PLAN output of a query as a newly allocated
+ * string, one line per step. */
+static char *sqlasync_thread_plan(sqlasync_t *s, const char *query) {
+	sqlite3_stmt *st;
+	char *sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+	int r = sqlite3_prepare_v2(s->db, sql, -1, &st, NULL);
+	sqlite3_free(sql);
+	if(r != SQLITE_OK || !st)
+		return NULL;
+
+	char *plan = NULL;
+	size_t len = 0;
+	while(sqlite3_step(st) == SQLITE_ROW) {
+		/* The last column has the description, the number of columns differs
+		 * between SQLite versions. */
+		const char *detail = (const char *)sqlite3_column_text(st, sqlite3_column_count(st)-1);
+		size_t dlen = detail ? strlen(detail) : 0;
+		plan = realloc(plan, len + dlen + 2);
+		if(len)
+			plan[len++] = '\n';
+		memcpy(plan+len, detail, dlen);
+		len += dlen;
+		plan[len] = 0;
+	}
+	sqlite3_finalize(st);
+	return plan;
+}
+
+
+/* Records the statistics of a finished SQL operation. */
+static void sqlasync_thread_instrument(sqlasync_t *s, sqlasync_op_t *op, sqlite3_stmt *st, int r, const struct timespec *started) {
+	sqlasync_opstat_t o;
+	memset(&o, 0, sizeof(o));
+	o.query = op->str;
+	o.result = r;
+	o.queued = op->queued;
+	o.started = *started;
+	clock_gettime(CLOCK_MONOTONIC, &o.finished);
+	o.rows = s->oprows;
+	/* COMPAT: sqlite3_stmt_status() was added in SQLite 3.6.4 (2008-10-15) */
+	if(st) {
+		o.fullscan_steps = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+		o.sorts = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_SORT, 1);
+#ifdef SQLITE_STMTSTATUS_VM_STEP /* Added in SQLite 3.20.0 (2017-08-01) */
+		o.vm_steps = sqlite3_stmt_status(st, SQLITE_STMTSTATUS_VM_STEP, 1);
+#endif
+	}
+	s->oprows = 0;
+
+	unsigned long long queue_time = (o.started.tv_sec - o.queued.tv_sec)*1000000LL + (o.started.tv_nsec - o.queued.tv_nsec)/1000;
+	unsigned long long exec_time = sqlasync_elapsed_us(started);
+	int slow = s->slowq && exec_time >= s->slowtime;
+
+	pthread_mutex_lock(&s->statslock);
+	s->stats.ops++;
+	s->stats.queue_time += queue_time;
+	s->stats.exec_time += exec_time;
+	s->stats.rows += o.rows;
+	s->stats.slow_queries += slow;
+	pthread_mutex_unlock(&s->statslock);
+
+	/* Aggregate by query string */
+	unsigned int h = 5381;
+	const char *c;
+	for(c=o.query; c && *c; c++)
+		h = h*33 + *c;
+	sqlasync_qstat_t *q = o.query ? s->qstats[h % SQLASYNC_QSTAT_BUCKETS] : NULL;
+	while(q && strcmp(q->query, o.query) != 0)
+		q = q->next;
+	if(!q && o.query && s->qstatnum < SQLASYNC_QSTAT_MAX) {
+		q = calloc(1, offsetof(sqlasync_qstat_t, query) + strlen(o.query) + 1);
+		strcpy(q->query, o.query);
+		q->next = s->qstats[h % SQLASYNC_QSTAT_BUCKETS];
+		s->qstats[h % SQLASYNC_QSTAT_BUCKETS] = q;
+		s->qstatnum++;
+	}
+	if(q) {
+		q->count++;
+		q->queue_time += queue_time;
+		q->exec_time += exec_time;
+		q->rows += o.rows;
+		q->fullscan_steps += o.fullscan_steps;
+		q->sorts += o.sorts;
+		q->vm_steps += o.vm_steps;
+	}
+
+	if(s->instrumentfunc)
+		s->instrumentfunc(s, &o, s->instrumentdata);
+
+	if(slow) {
+		sqlasync_result_t *res = sqlasync_result_create(r, 0, 8);
+		char *plan = sqlasync_thread_plan(s, o.query);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, o.query);
+		res->col[1] = sqlasync_int(queue_time);
+		res->col[2] = sqlasync_int(exec_time);
+		res->col[3] = sqlasync_int(o.rows);
+		res->col[4] = sqlasync_int(o.fullscan_steps);
+		res->col[5] = sqlasync_int(o.sorts);
+		res->col[6] = sqlasync_int(o.vm_steps);
+		res->col[7] = plan ? sqlasync_text(SQLASYNC_FREE, plan) : sqlasync_null();
+		sqlasync_queue_result(s->slowq, res);
+	}
+}
+
+
+/* Custom function for sqlasync_querystats() */
+static void sqlasync_thread_querystats(sqlasync_t *s, sqlite3 *db, sqlasync_queue_t *q, int val_num, sqlasync_value_t *values) {
+	unsigned int i;
+	sqlasync_qstat_t *qs;
+	for(i=0; i<SQLASYNC_QSTAT_BUCKETS; i++)
+		for(qs=s->qstats[i]; qs; qs=qs->next) {
+			sqlasync_result_t *res = sqlasync_result_create(SQLITE_ROW, 0, 8);
+			res->col[0] = sqlasync_text(SQLASYNC_COPY, qs->query);
+			res->col[1] = sqlasync_int(qs->count);
+			res->col[2] = sqlasync_int(qs->queue_time);
+			res->col[3] = sqlasync_int(qs->exec_time);
+			res->col[4] = sqlasync_int(qs->rows);
+			res->col[5] = sqlasync_int(qs->fullscan_steps);
+			res->col[6] = sqlasync_int(qs->sorts);
+			res->col[7] = sqlasync_int(qs->vm_steps);
+			sqlasync_queue_result(q, res);
+		}
+	sqlasync_queue_result(q, sqlasync_result_create(SQLITE_DONE, 1, 0));
 }
 
 
 static void sqlasync_thread_sql(sqlasync_t *s, sqlasync_op_t *op) {
 	sqlite3_stmt *st = NULL;
 	int r = SQLITE_ERROR;
-
-	/* SINGLE queries can be executed here */
-	if((op->flags & SQLASYNC_SINGLE) == SQLASYNC_SINGLE) {
+	int mode = op->flags & SQLASYNC_SINGLE;
+	int many = op->flags & SQLASYNC_MANY;
+	struct timespec started;
+	if(s->instrumented)
+		clock_gettime(CLOCK_MONOTONIC, &started);
+
+	/* SINGLE queries can be executed here. A bulk query still gets a
+	 * transaction of its own. */
+	if(mode == SQLASYNC_SINGLE) {
+		if(many)
+			sqlasync_thread_begin(s);
 		r = sqlasync_thread_exec(s, op, &st);
-		goto final;
+		goto commit;
 	}
 
 	/* If we're in a NEXT-chain and the transaction has been aborted, report error. */
 	if(s->errtrans) {
-		if((op->flags & SQLASYNC_SINGLE) != SQLASYNC_NEXT)
+		if(mode != SQLASYNC_NEXT)
 			s->errtrans = 0;
 		/* TODO: More specific error code? What error string will
 		 * sqlasync_thread_final() give back, exactly? */
@@ -626,24 +2307,20 @@ static void sqlasync_thread_sql(sqlasync_t *s, sqlasync_op_t *op) {
 
 	/* If this is a LAST query, or the last query in a NEXT chain and we don't
 	 * have a transaction timeout, then the result of the commit operation
-	 * should be sent back as the result of the query. */
-	if((op->flags & SQLASYNC_SINGLE) == SQLASYNC_LAST ||
-			(!sqlasync_havetranstimeout(s) && s->donext && (op->flags & SQLASYNC_SINGLE) != SQLASYNC_NEXT)) {
+	 * should be sent back as the result of the query. The same applies to a
+	 * bulk query that isn't part of a larger transaction. */
+	if(mode == SQLASYNC_LAST ||
+			(!sqlasync_havetranstimeout(s) && mode != SQLASYNC_NEXT && (s->donext || many))) {
+		if(many && !s->intrans)
+			sqlasync_thread_begin(s);
+		else if(s->intrans && sqlasync_havetranstimeout(s) && !s->insavepoint)
+			sqlasync_thread_savepoint(s);
 		r = sqlasync_thread_exec(s, op, &st);
-		/* Rollback even if st == NULL (i.e. query parsing failed). Even if we
-		 * could still validly try a commit, we have to return an error anyway.
-		 * We have currently no way of saying "Hey, your query failed, but
-		 * comitting your previous stuff went fine".
-		 * (It's an obscure situation in any case). */
-		if(s->intrans && r != SQLITE_DONE)
-			sqlasync_thread_rollback(s);
-		if(s->intrans && r == SQLITE_DONE)
-			r = sqlasync_thread_commit(s);
-		goto final;
+		goto commit;
 	}
 
 	/* If we need to start a new transaction, let's do so */
-	if(!s->intrans && ((op->flags & SQLASYNC_SINGLE) == SQLASYNC_NEXT || sqlasync_havetranstimeout(s))) {
+	if(!s->intrans && (mode == SQLASYNC_NEXT || sqlasync_havetranstimeout(s))) {
 		sqlasync_thread_begin(s);
 		if(sqlasync_havetranstimeout(s)) {
 			clock_gettime(CLOCK_MONOTONIC, &s->trans);
@@ -651,44 +2328,436 @@ static void sqlasync_thread_sql(sqlasync_t *s, sqlasync_op_t *op) {
 		}
 	}
 
+	if(s->intrans && sqlasync_havetranstimeout(s) && !s->insavepoint)
+		sqlasync_thread_savepoint(s);
+
 	/* Normal/NEXT query */
 	r = sqlasync_thread_exec(s, op, &st);
 
-	if(st && r != SQLITE_DONE) {
-		if(s->intrans)
+	if((st || s->abortmsg) && r != SQLITE_DONE) {
+		/* Some errors cause SQLite to roll back the entire transaction, a
+		 * savepoint doesn't help us in that case. */
+		if(s->insavepoint && !sqlite3_get_autocommit(s->db))
+			sqlasync_thread_savepoint_end(s, 1);
+		else if(s->intrans)
 			sqlasync_thread_rollback(s);
-		if((op->flags & SQLASYNC_SINGLE) == SQLASYNC_NEXT)
+		if(mode == SQLASYNC_NEXT)
 			s->errtrans = 1;
-	}
+	} else if(s->insavepoint && mode != SQLASYNC_NEXT)
+		sqlasync_thread_savepoint_end(s, 0);
+	goto final;
+
+commit:
+	/* If the query failed within a savepoint, the rest of the transaction can
+	 * still be committed. */
+	if(s->insavepoint && r != SQLITE_DONE && !sqlite3_get_autocommit(s->db)) {
+		sqlasync_thread_savepoint_end(s, 1);
+		sqlasync_thread_groupcommit(s);
+	} else if(s->insavepoint && r == SQLITE_DONE)
+		sqlasync_thread_savepoint_end(s, 0);
+
+	/* Without a savepoint, rollback even if st == NULL (i.e. query parsing
+	 * failed). Even if we could still validly try a commit, we have to return
+	 * an error anyway. We have no way of saying "Hey, your query failed, but
+	 * comitting your previous stuff went fine".
+	 * (It's an obscure situation in any case). */
+	if(s->intrans && r != SQLITE_DONE)
+		sqlasync_thread_rollback(s);
+	if(s->intrans && r == SQLITE_DONE)
+		r = sqlasync_thread_commit(s);
 
 final:
+	/* Update the cache before passing back the result, so that the
+	 * application won't see stale results after a modification */
+	if(s->capturing)
+		sqlasync_thread_capture_end(s, st, r);
+	sqlasync_thread_invalidate(s, st);
 	sqlasync_thread_final(s, op, r);
+	s->curop = NULL;
+	s->abortmsg = NULL;
+	if(s->instrumented)
+		sqlasync_thread_instrument(s, op, st, r, &started);
 	if(st) {
 		sqlite3_reset(st);
-		sqlite3_finalize(st);
+		/* COMPAT: sqlite3_clear_bindings() was added in SQLite 3.3.10 (2007-01-09) */
+		if(sqlasync_bufmanage(op->flags) == SQLASYNC_INTERNED && sqlasync_intern_get(op->str)->st == st)
+			sqlite3_clear_bindings(st);
+		else
+			sqlite3_finalize(st);
 	}
 }
 
 
+/* Runs a checkpoint on the given connection, escalating to ckptmode if the WAL
+ * has grown too large. */
+static void sqlasync_ckpt_run(sqlasync_t *s, sqlite3 *db) {
+	int log = -1, done = -1, escalated = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* COMPAT: sqlite3_wal_checkpoint_v2() was added in SQLite 3.7.6 (2011-04-12)
+	 * A connection only notices that the database has been switched to WAL
+	 * mode when it reads from it, hence the retry. */
+	int r = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log, &done);
+	if(r == SQLITE_OK && log < 0) {
+		sqlite3_exec(db, "PRAGMA schema_version", NULL, NULL, NULL);
+		r = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log, &done);
+	}
+	if(r == SQLITE_OK && s->ckptmaxwal && log > (int)s->ckptmaxwal)
+		escalated = sqlite3_wal_checkpoint_v2(db, NULL, s->ckptmode, &log, &done) == SQLITE_OK;
+
+	/* Not in WAL mode */
+	if(log < 0)
+		return;
+	pthread_mutex_lock(&s->statslock);
+	s->stats.checkpoints++;
+	s->stats.checkpoint_time += sqlasync_elapsed_us(&start);
+	s->stats.checkpoint_escalations += escalated;
+	s->stats.wal_size = log;
+	pthread_mutex_unlock(&s->statslock);
+}
+
+
+/* The checkpoint thread. Uses its own connection, so that the database thread
+ * can continue processing queries while a checkpoint is running. */
+static void *sqlasync_ckpt_thread(void *dat) {
+	sqlasync_t *s = dat;
+	pthread_mutex_lock(&s->ckptlock);
+	while(1) {
+		while(!s->ckptpending && !s->ckptquit)
+			pthread_cond_wait(&s->ckptcond, &s->ckptlock);
+		if(s->ckptquit)
+			break;
+		s->ckptpending = 0;
+		pthread_mutex_unlock(&s->ckptlock);
+		sqlasync_ckpt_run(s, s->ckptdb);
+		pthread_mutex_lock(&s->ckptlock);
+	}
+	pthread_mutex_unlock(&s->ckptlock);
+	return NULL;
+}
+
+
+static void sqlasync_thread_ckpt_signal(sqlasync_t *s) {
+	pthread_mutex_lock(&s->ckptlock);
+	s->ckptpending = 1;
+	pthread_cond_signal(&s->ckptcond);
+	pthread_mutex_unlock(&s->ckptlock);
+	s->ckptdirty = 0;
+}
+
+
+/* Starts the checkpoint thread after the database has been opened. The
+ * checkpoint connection is opened here, with the same name and flags as the
+ * database connection, so that it uses the same file and VFS. In-memory and
+ * temporary databases don't have a file that another connection can open,
+ * those keep SQLite's default behaviour. So does a database for which the
+ * checkpoint connection can't be opened, the error is reported on the
+ * database queue. */
+static void sqlasync_thread_ckpt_start(sqlasync_t *s, sqlasync_op_t *op) {
+	/* COMPAT: sqlite3_db_filename() was added in SQLite 3.7.10 (2012-01-16) */
+	const char *fn = sqlite3_db_filename(s->db, "main");
+	if(!s->ckptenabled || s->persist.db || !fn || !*fn)
+		return;
+
+	int r = op->args[0].val.i64
+		? sqlite3_open_v2(op->str, &s->ckptdb, op->args[0].val.i64, NULL)
+		: sqlite3_open(op->str, &s->ckptdb);
+	if(r != SQLITE_OK) {
+		sqlasync_result_t *res = sqlasync_result_create(r, 0, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->ckptdb));
+		sqlasync_queue_result(s->dbqueue, res);
+		sqlite3_close(s->ckptdb);
+		s->ckptdb = NULL;
+		return;
+	}
+	sqlite3_wal_autocheckpoint(s->ckptdb, 0);
+	/* An escalated checkpoint gives up after this time, and will be tried
+	 * again the next time the database thread is idle. */
+	sqlite3_busy_timeout(s->ckptdb, SQLASYNC_CKPT_BUSY);
+
+	s->ckptpending = s->ckptquit = 0;
+	if(pthread_create(&s->ckptthread, NULL, sqlasync_ckpt_thread, s)) {
+		sqlite3_close(s->ckptdb);
+		s->ckptdb = NULL;
+		return;
+	}
+	sqlite3_wal_autocheckpoint(s->db, 0);
+}
+
+
+static void sqlasync_thread_ckpt_stop(sqlasync_t *s) {
+	if(!s->ckptdb)
+		return;
+	pthread_mutex_lock(&s->ckptlock);
+	s->ckptquit = 1;
+	pthread_cond_signal(&s->ckptcond);
+	pthread_mutex_unlock(&s->ckptlock);
+	pthread_join(s->ckptthread, NULL);
+	sqlite3_close(s->ckptdb);
+	s->ckptdb = NULL;
+	s->ckptdirty = 0;
+}
+
+
+/* Online backup. Backup steps are run from sqlasync_thread_getnext() when the
+ * database thread is between operations and not in a transaction, so that
+ * the backup doesn't hold the database lock while other queries wait.
+ * COMPAT: The backup API was added in SQLite 3.6.11 (2009-02-15) */
+
+static void sqlasync_thread_backup_end(sqlasync_t *s, int r) {
+	sqlasync_result_t *res;
+	int pagecount = sqlite3_backup_pagecount(s->backup.b);
+	if(sqlite3_backup_finish(s->backup.b) != SQLITE_OK && r == SQLITE_DONE)
+		r = sqlite3_errcode(s->backup.db);
+	if(r == SQLITE_DONE) {
+		res = sqlasync_result_create(r, 1, 2);
+		res->col[0] = sqlasync_int(pagecount);
+		res->col[1] = sqlasync_int(sqlasync_elapsed_us(&s->backup.start));
+	} else {
+		res = sqlasync_result_create(r, 1, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->backup.db));
+	}
+	sqlite3_close(s->backup.db);
+	s->backup.db = NULL;
+	s->backup.b = NULL;
+	sqlasync_queue_result(s->backup.q, res);
+}
+
+
+static void sqlasync_thread_backup_step(sqlasync_t *s, int pages) {
+	int r = sqlite3_backup_step(s->backup.b, pages);
+	if(r == SQLITE_DONE || (r != SQLITE_OK && r != SQLITE_BUSY && r != SQLITE_LOCKED)) {
+		sqlasync_thread_backup_end(s, r);
+		return;
+	}
+	/* The destination is locked by someone else, just try again later */
+	if(r == SQLITE_OK) {
+		sqlasync_result_t *res = sqlasync_result_create(SQLITE_OK, 0, 2);
+		res->col[0] = sqlasync_int(sqlite3_backup_remaining(s->backup.b));
+		res->col[1] = sqlasync_int(sqlite3_backup_pagecount(s->backup.b));
+		sqlasync_queue_result(s->backup.q, res);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s->backup.next);
+	s->backup.next = sqlasync_timespec_add(s->backup.next, s->backup.pause);
+}
+
+
+/* Run a backup step if one is due. Returns whether a backup is in progress */
+static int sqlasync_thread_backup_poll(sqlasync_t *s) {
+	if(!s->backup.b)
+		return 0;
+	if(!s->intrans && !s->donext && sqlasync_timespec_passed(&s->backup.next))
+		sqlasync_thread_backup_step(s, s->backup.pages);
+	return !!s->backup.b;
+}
+
+
+static void sqlasync_thread_backup(sqlasync_t *s, sqlasync_op_t *op) {
+	int r = SQLITE_OK;
+	const char *msg = NULL;
+	sqlite3 *db = NULL;
+	sqlite3_backup *b = NULL;
+
+	s->curop = op;
+	if(sqlasync_thread_aborted(s))
+		r = SQLITE_INTERRUPT;
+	else if(s->backup.b) {
+		r = SQLITE_MISUSE;
+		msg = "A backup is already in progress";
+	} else if(!s->db) {
+		r = SQLITE_MISUSE;
+		msg = "Database not open";
+	} else if((r = sqlite3_open(op->str, &db)) != SQLITE_OK ||
+			!(b = sqlite3_backup_init(db, "main", s->db, "main"))) {
+		r = sqlite3_errcode(db);
+		msg = sqlite3_errmsg(db);
+	}
+
+	if(r != SQLITE_OK) {
+		if(msg) {
+			sqlasync_result_t *res = sqlasync_result_create(r, 1, 1);
+			res->col[0] = sqlasync_text(SQLASYNC_COPY, msg);
+			sqlasync_queue_result(op->q, res);
+		} else
+			sqlasync_thread_final(s, op, r);
+		sqlite3_close(db);
+	} else {
+		s->backup.db = db;
+		s->backup.b = b;
+		s->backup.q = op->q;
+		s->backup.pages = op->args[0].val.i64 > 0 ? op->args[0].val.i64 : -1;
+		s->backup.pause.tv_sec = op->args[1].val.i64 / 1000;
+		s->backup.pause.tv_nsec = (op->args[1].val.i64 % 1000) * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &s->backup.start);
+		s->backup.next = s->backup.start;
+	}
+	s->curop = NULL;
+	s->abortmsg = NULL;
+}
+
+
+/* Write-behind persistence. The in-memory database is copied to the file with
+ * the backup API, a bounded number of pages per step, from
+ * sqlasync_thread_getnext() between operations, like an online backup. The
+ * file is only written between steps, so a query never waits for more than a
+ * single step. Commits made by the database connection while a copy is in
+ * progress are applied to the copy by SQLite, so the copy that completes
+ * holds all of them.
+ * COMPAT: The in-memory database uses the memdb VFS, which was added in SQLite
+ * 3.36.0 (2021-06-18). A stepped backup from a plain ":memory:" database is
+ * restarted on every write and would never complete under a steady load. */
+
+/* Ends the copy in progress. Errors are reported on the database queue,
+ * except for a locked file when the copy will be retried. */
+static void sqlasync_thread_persist_end(sqlasync_t *s, int r, int final) {
+	int fr = sqlite3_backup_finish(s->persist.b);
+	s->persist.b = NULL;
+	if(fr != SQLITE_OK && r == SQLITE_DONE)
+		r = fr;
+	if(r == SQLITE_DONE)
+		s->persist.dirty = 0;
+	else if(final || (r != SQLITE_BUSY && r != SQLITE_LOCKED)) {
+		/* A locked file is not an error as far as sqlite3_backup_finish() is
+		 * concerned, so it doesn't leave a message */
+		sqlasync_result_t *res = sqlasync_result_create(r, 0, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, fr != SQLITE_OK ? sqlite3_errmsg(s->persist.db) : sqlite3_errstr(r));
+		sqlasync_queue_result(s->dbqueue, res);
+	}
+}
+
+
+/* Runs a step of the copy, starting a new one if necessary. A copy that can't
+ * proceed because the file is locked is continued after another interval, a
+ * failed copy is started over after another interval. */
+static void sqlasync_thread_persist_step(sqlasync_t *s) {
+	if(!s->persist.b && !(s->persist.b = sqlite3_backup_init(s->persist.db, "main", s->db, "main"))) {
+		sqlasync_result_t *res = sqlasync_result_create(sqlite3_errcode(s->persist.db), 0, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->persist.db));
+		sqlasync_queue_result(s->dbqueue, res);
+	} else {
+		int r = sqlite3_backup_step(s->persist.b, SQLASYNC_PERSIST_PAGES);
+		if(r == SQLITE_OK)
+			return;
+		if(r != SQLITE_BUSY && r != SQLITE_LOCKED)
+			sqlasync_thread_persist_end(s, r, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &s->persist.next);
+	s->persist.next = sqlasync_timespec_add(s->persist.next, s->persist.interval);
+}
+
+
+/* Run a step of the copy if one is due. Returns whether there are changes
+ * left to copy. */
+static int sqlasync_thread_persist_poll(sqlasync_t *s) {
+	if(!s->persist.db || (!s->persist.dirty && !s->persist.b))
+		return 0;
+	if(s->intrans || s->donext || !sqlasync_timespec_passed(&s->persist.next))
+		return 1;
+
+	/* The application has a transaction open, try again later */
+	if(!sqlite3_get_autocommit(s->db)) {
+		clock_gettime(CLOCK_MONOTONIC, &s->persist.next);
+		s->persist.next = sqlasync_timespec_add(s->persist.next, s->persist.interval);
+		return 1;
+	}
+	sqlasync_thread_persist_step(s);
+	return s->persist.dirty || s->persist.b;
+}
+
+
+/* Completes the copy in progress, or makes a final one, and closes the file */
+static void sqlasync_thread_persist_stop(sqlasync_t *s) {
+	if(s->persist.dirty && !s->persist.b)
+		s->persist.b = sqlite3_backup_init(s->persist.db, "main", s->db, "main");
+	if(s->persist.b)
+		sqlasync_thread_persist_end(s, sqlite3_backup_step(s->persist.b, -1), 1);
+	else if(s->persist.dirty) {
+		sqlasync_result_t *res = sqlasync_result_create(sqlite3_errcode(s->persist.db), 0, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->persist.db));
+		sqlasync_queue_result(s->dbqueue, res);
+	}
+	sqlite3_close(s->persist.db);
+	s->persist.db = NULL;
+	s->persist.dirty = 0;
+}
+
+
+/* Opens the file and loads it into a new in-memory database. The file
+ * connection is tuned as usual, since it determines the durability of the
+ * copies. Returns the connection that holds the error on failure. */
+static sqlite3 *sqlasync_thread_persist_open(sqlasync_t *s, sqlasync_op_t *op, int *r) {
+	sqlite3_backup *b;
+	*r = op->args[0].val.i64
+		? sqlite3_open_v2(op->str, &s->persist.db, op->args[0].val.i64, NULL)
+		: sqlite3_open(op->str, &s->persist.db);
+	if(!*r && s->tunesql)
+		*r = sqlite3_exec(s->persist.db, s->tunesql, NULL, NULL, NULL);
+	if(*r)
+		return s->persist.db;
+
+	/* The backup sets the page size of the in-memory database to that of the
+	 * file. A memdb name without a leading slash gives a database private to
+	 * this connection. */
+	*r = sqlite3_open_v2("file:sqlasync?vfs=memdb", &s->db,
+		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_URI, NULL);
+	if(*r != SQLITE_OK)
+		return s->db;
+	if(!(b = sqlite3_backup_init(s->db, "main", s->persist.db, "main"))) {
+		*r = sqlite3_errcode(s->db);
+		return s->db;
+	}
+	sqlite3_backup_step(b, -1);
+	*r = sqlite3_backup_finish(b);
+
+	s->persist.dirty = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s->persist.next);
+	s->persist.next = sqlasync_timespec_add(s->persist.next, s->persist.interval);
+	return s->db;
+}
+
+
 static void sqlasync_thread_open(sqlasync_t *s, sqlasync_op_t *op) {
 	assert("Database already open" && !s->db);
 
 	/* COMPAT: sqlite3_open_v2() was added in SQLite 3.5.0 (2007-09-04) */
-	int r = op->args[0].val.i64
-		? sqlite3_open_v2(op->str, &s->db, op->args[0].val.i64, NULL)
-		: sqlite3_open(op->str, &s->db);
+	int r;
+	sqlite3 *errdb;
+	if(s->persist.enabled)
+		errdb = sqlasync_thread_persist_open(s, op, &r);
+	else {
+		r = op->args[0].val.i64
+			? sqlite3_open_v2(op->str, &s->db, op->args[0].val.i64, NULL)
+			: sqlite3_open(op->str, &s->db);
+		errdb = s->db;
+	}
+	/* A database that can't be tuned is reported as a failed open, the
+	 * application shouldn't have to check for half-configured connections. */
+	if(!r && s->tunesql)
+		r = sqlite3_exec(s->db, s->tunesql, NULL, NULL, NULL);
 
 	sqlasync_result_t *res;
 	if(r) {
 		res = sqlasync_result_create(r, 1, 1);
-		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->db));
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(errdb));
 		sqlite3_close(s->db);
-		s->db = NULL;
+		sqlite3_close(s->persist.db);
+		s->db = s->persist.db = NULL;
 	} else {
 		res = sqlasync_result_create(r, 1, 0);
 		s->dbqueue = op->args[1].val.ptr;
-		/* TODO: Make the busy handling configurable? */
-		sqlite3_busy_timeout(s->db, 10);
+		sqlite3_busy_handler(s->db, sqlasync_thread_busy, s);
+		sqlite3_progress_handler(s->db, SQLASYNC_PROGRESS_OPS, sqlasync_thread_progress, s);
+		sqlasync_thread_ckpt_start(s, op);
+		if(s->cachemax) {
+			/* COMPAT: sqlite3_stmt_readonly() was added in SQLite 3.7.4 (2010-12-07) */
+			sqlite3_set_authorizer(s->db, sqlasync_thread_authorizer, s);
+			sqlite3_update_hook(s->db, sqlasync_thread_update, s);
+		}
+		if(s->persist.db || s->ckptdb) {
+			sqlite3_commit_hook(s->db, sqlasync_thread_commithook, s);
+			sqlite3_rollback_hook(s->db, sqlasync_thread_rollbackhook, s);
+		}
 	}
 	sqlasync_queue_result(op->q, res);
 
@@ -703,40 +2772,230 @@ static void sqlasync_thread_open(sqlasync_t *s, sqlasync_op_t *op) {
 static void sqlasync_thread_close(sqlasync_t *s) {
 	/* We may be called even when there isn't a database open, so ensure that
 	 * all called functions properly handle NULL arguments. */
+	sqlasync_intern_t *in;
+	pthread_mutex_lock(&s->internlock);
+	for(in=s->interned; in; in=in->next) {
+		sqlite3_finalize(in->st);
+		in->st = NULL;
+	}
+	pthread_mutex_unlock(&s->internlock);
+	/* Cursors that haven't been exhausted yet will return an error */
+	sqlasync_cursor_t *c;
+	for(c=s->cursors; c; c=c->next) {
+		sqlite3_finalize(c->st);
+		c->st = NULL;
+	}
 	sqlite3_finalize(s->begin);
 	sqlite3_finalize(s->commit);
 	sqlite3_finalize(s->rollback);
+	sqlite3_finalize(s->savepoint);
+	sqlite3_finalize(s->release);
+	sqlite3_finalize(s->rollbackto);
+	/* Subscriptions end with the connection */
+	if(s->cdccommit)
+		sqlasync_thread_cdc_flush(s);
+	sqlasync_thread_unsubscribe(s, NULL);
+	/* A backup in progress is completed rather than thrown away. If the final
+	 * step can't finish it (e.g. the destination is locked), the backup still
+	 * ends here with that error as its last result. */
+	if(s->backup.b) {
+		int r = sqlite3_backup_step(s->backup.b, -1);
+		sqlasync_thread_backup_end(s, r == SQLITE_OK ? SQLITE_BUSY : r);
+	}
+	/* Close the checkpoint connection first, so that the last connection to
+	 * close can clean up the WAL */
+	sqlasync_thread_ckpt_stop(s);
+	if(s->cachemax)
+		sqlasync_thread_cache_remove(s, NULL, 0);
+	/* Final copy of an in-memory database. A transaction left open by the
+	 * application would be rolled back by the close anyway. */
+	if(s->persist.db) {
+		if(!sqlite3_get_autocommit(s->db))
+			sqlite3_exec(s->db, "ROLLBACK", NULL, NULL, NULL);
+		sqlasync_thread_persist_stop(s);
+	}
 	sqlite3_close(s->db); /* Can't really fail */
 	sqlasync_queue_result(s->dbqueue, sqlasync_result_create(SQLITE_OK, 1, 0));
 	s->db = NULL;
 	s->dbqueue = NULL;
 	s->begin = s->commit = s->rollback = NULL;
+	s->savepoint = s->release = s->rollbackto = NULL;
 }
 
 
-/* Only returns NULL if the current transaction has timed out */
+/* Number of bytes of bound data in an operation */
+static unsigned int sqlasync_op_bytes(sqlasync_op_t *op) {
+	unsigned int i, n = 0;
+	for(i=0; i<op->numargs; i++)
+		switch(op->args[i].type) {
+		case SQLITE3_TEXT: n += strlen(op->args[i].val.ptr); break;
+		case SQLITE_BLOB:  n += op->args[i].length; break;
+		default:           n += 8;
+		}
+	return n;
+}
+
+
+/* Whether the current group transaction has reached its size limits */
+#define sqlasync_groupfull(s) (\
+		(s->groupops      && s->transops   >= s->groupops) ||\
+		(s->groupmaxbytes && s->transbytes >= s->groupmaxbytes))
+
+
+/* Moves everything from the submission stacks into the FIFO queues. */
+static void sqlasync_thread_take(sqlasync_t *s) {
+	int lane;
+	for(lane=0; lane<2; lane++) {
+		sqlasync_op_t *next, *list = NULL;
+		sqlasync_op_t *op = __atomic_exchange_n(&s->submitted[lane], NULL, __ATOMIC_ACQUIRE);
+
+		while(op) {
+			next = op->next;
+			op->next = list;
+			list = op;
+			op = next;
+		}
+		if(!list)
+			continue;
+		for(op=list; op->next; op=op->next)
+			;
+		queue_push(&s->lanes[lane], list, op);
+	}
+}
+
+
+#define sqlasync_thread_queued(s) ((s)->lanes[0].first || (s)->lanes[1].first)
+
+
+/* Only returns NULL if the current transaction should be committed */
 static sqlasync_op_t *sqlasync_thread_getnext(sqlasync_t *s) {
 	sqlasync_op_t *op = NULL;
+	int timedout = 0;
+
+	/* Commit early if the group is full, or if there's nothing left to group
+	 * with and we've been asked not to wait */
+	if(s->intrans && !s->donext && sqlasync_groupfull(s))
+		return NULL;
+	sqlasync_thread_backup_poll(s);
+	sqlasync_thread_persist_poll(s);
+	sqlasync_thread_take(s);
+	if(s->intrans && !s->donext && !sqlasync_thread_queued(s) && (s->groupflags & SQLASYNC_GROUP_IDLE))
+		return NULL;
 
-	/* If donext, then we shouldn't wait.
+	/* If donext, then we shouldn't wait. A NEXT chain is always submitted as
+	 * a whole, so the next operation will already be in our queue.
 	 * If intrans, then we should do a timedwait,
 	 * Otherwise, regular wait.
 	 */
-	pthread_mutex_lock(&s->lock);
-	while(!s->donext && !s->first) {
-		if(!s->intrans)
-			pthread_cond_wait(&s->cond, &s->lock);
-		else if(pthread_cond_timedwait(&s->cond, &s->lock, &s->trans) == ETIMEDOUT)
-			break;
+	while(!s->donext && !sqlasync_thread_queued(s) && !timedout) {
+		/* We're idle, good time for a checkpoint */
+		if(s->ckptdirty && !s->intrans)
+			sqlasync_thread_ckpt_signal(s);
+		/* Wake up for whichever of the backup and persistence is due first */
+		struct timespec *wake = sqlasync_thread_backup_poll(s) ? &s->backup.next : NULL;
+		if(sqlasync_thread_persist_poll(s) && (!wake || !sqlasync_timespec_before(wake, &s->persist.next)))
+			wake = &s->persist.next;
+		pthread_mutex_lock(&s->waitlock);
+		__atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+		if(!__atomic_load_n(&s->submitted[0], __ATOMIC_SEQ_CST) && !__atomic_load_n(&s->submitted[1], __ATOMIC_SEQ_CST)) {
+			if(!s->intrans && wake)
+				pthread_cond_timedwait(&s->cond, &s->waitlock, wake);
+			else if(!s->intrans)
+				pthread_cond_wait(&s->cond, &s->waitlock);
+			else
+				timedout = pthread_cond_timedwait(&s->cond, &s->waitlock, &s->trans) == ETIMEDOUT;
+		}
+		__atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&s->waitlock);
+		sqlasync_thread_take(s);
+	}
+
+	/* Prefer the high priority lane, except when we're in the middle of a
+	 * NEXT chain. Priority operations can't run before the database has been
+	 * opened, so don't let them overtake an open. */
+	if(!s->donext)
+		s->lane = s->lanes[1].first && (s->db || !s->lanes[0].first);
+	if(s->lanes[s->lane].first) {
+		op = s->lanes[s->lane].first;
+		queue_pop(&s->lanes[s->lane]);
+	}
+
+	assert("An SQLASYNC_NEXT was queued, but there is no next query" && (op || !s->donext));
+	return op;
+}
+
+
+/* Prepares the statement of a cursor. Interned queries are not taken from the
+ * statement cache, since the cached statement may be needed by other queries
+ * while the cursor is open. */
+static void sqlasync_thread_cursor_open(sqlasync_t *s, sqlasync_op_t *op) {
+	sqlasync_cursor_t *c = op->args[0].val.ptr;
+	int r;
+
+	s->curop = op;
+	if(sqlasync_thread_aborted(s))
+		r = SQLITE_INTERRUPT;
+	else if((r = sqlite3_prepare_v2(s->db, op->str, -1, &c->st, NULL)) != SQLITE_OK) {
+		sqlite3_finalize(c->st);
+		c->st = NULL;
+	} else if(!c->st)
+		c->done = 1;
+	else
+		sqlasync_thread_bind(op->args+1, op->numargs-1, c->st);
+	/* Also keep track of cursors that failed to open, so that those left
+	 * unclosed can be freed by sqlasync_destroy() */
+	c->next = s->cursors;
+	s->cursors = c;
+	sqlasync_thread_final(s, op, r);
+	s->curop = NULL;
+	s->abortmsg = NULL;
+}
+
+
+static void sqlasync_thread_cursor_next(sqlasync_t *s, sqlasync_op_t *op) {
+	sqlasync_cursor_t *c = op->args[0].val.ptr;
+	unsigned int n = op->args[1].val.i64;
+
+	if(!c->st && !c->done) {
+		sqlasync_result_t *res = sqlasync_result_create(SQLITE_MISUSE, 1, 1);
+		res->col[0] = sqlasync_text(SQLASYNC_COPY, "Cursor is not open");
+		sqlasync_thread_result(s, c->q, res);
+		return;
+	}
+
+	int r = c->done ? SQLITE_DONE : SQLITE_OK;
+	s->curop = op;
+	if(sqlasync_thread_aborted(s))
+		r = SQLITE_INTERRUPT;
+	else if(!c->done) {
+		while(n > 0 && (r = sqlite3_step(c->st)) == SQLITE_ROW) {
+			sqlasync_thread_row(s, c->q, c->st);
+			n--;
+		}
+		if(r == SQLITE_ROW)
+			r = SQLITE_OK;
 	}
-	if(s->first) {
-		op = s->first;
-		queue_pop(s);
+	sqlasync_thread_invalidate(s, c->st);
+	sqlasync_thread_final(s, op, r);
+
+	/* Release the locks held by the statement as soon as we're done with it */
+	if(r != SQLITE_OK && !c->done) {
+		c->done = 1;
+		sqlite3_reset(c->st);
 	}
-	pthread_mutex_unlock(&s->lock);
+	s->curop = NULL;
+	s->abortmsg = NULL;
+}
 
-	assert("An SQLASYNC_NEXT was queued, but there is no next query" && (op || !s->donext));
-	return op;
+
+static void sqlasync_thread_cursor_close(sqlasync_t *s, sqlasync_op_t *op) {
+	sqlasync_cursor_t **c = &s->cursors, *cur = op->args[0].val.ptr;
+	while(*c && *c != cur)
+		c = &(*c)->next;
+	if(*c)
+		*c = cur->next;
+	sqlite3_finalize(cur->st);
+	free(cur);
 }
 
 
@@ -745,7 +3004,9 @@ static void *sqlasync_thread(void *dat) {
 	sqlasync_op_t *op = NULL;
 
 	while(1) {
-		sqlasync_op_free(op);
+		sqlasync_op_free(s, op);
+		if(s->cdccommit)
+			sqlasync_thread_cdc_flush(s);
 		op = sqlasync_thread_getnext(s);
 		int flags = op ? op->flags : 0;
 
@@ -755,12 +3016,7 @@ static void *sqlasync_thread(void *dat) {
 				 flags == SQLASYNC_QUIT || flags == SQLASYNC_CUSTOM ||
 				 (flags & SQLASYNC_SINGLE) == SQLASYNC_SINGLE))) {
 			assert("Can't close a transaction when we still have a SQLASYNC_NEXT to process" && !s->donext);
-			int r = sqlasync_thread_commit(s);
-			if(r != SQLITE_DONE) {
-				sqlasync_result_t *res = sqlasync_result_create(r, 0, 1);
-				res->col[0] = sqlasync_text(SQLASYNC_COPY, sqlite3_errmsg(s->db));
-				sqlasync_queue_result(s->dbqueue, res);
-			}
+			sqlasync_thread_groupcommit(s);
 		}
 
 		if(!op)
@@ -775,17 +3031,55 @@ static void *sqlasync_thread(void *dat) {
 			continue;
 		} else if(flags == SQLASYNC_QUIT)
 			break;
-		else if(flags == SQLASYNC_CUSTOM) {
-			((sqlasync_custom_func_t)op->args[0].val.ptr)(s, s->db, op->q, op->numargs-1, op->args+1);
+		else if(sqlasync_special(flags) == SQLASYNC_CURSOR_OPEN) {
+			sqlasync_thread_cursor_open(s, op);
+			continue;
+		} else if(sqlasync_special(flags) == SQLASYNC_CURSOR_NEXT) {
+			sqlasync_thread_cursor_next(s, op);
+			continue;
+		} else if(sqlasync_special(flags) == SQLASYNC_CURSOR_CLOSE) {
+			sqlasync_thread_cursor_close(s, op);
+			continue;
+		} else if(flags == SQLASYNC_BACKUP) {
+			sqlasync_thread_backup(s, op);
+			continue;
+		} else if(flags == SQLASYNC_SUBSCRIBE) {
+			sqlasync_thread_subscribe(s, op);
+			continue;
+		} else if(flags == SQLASYNC_UNSUBSCRIBE) {
+			sqlasync_thread_unsubscribe(s, op->q);
+			continue;
+		} else if(flags == SQLASYNC_CUSTOM) {
+			/* Custom operations are only checked before they're started */
+			s->curop = op;
+			int aborted = sqlasync_thread_aborted(s);
+			if(aborted)
+				sqlasync_thread_final(s, op, SQLITE_INTERRUPT);
+			s->curop = NULL;
+			s->abortmsg = NULL;
+			if(!aborted) {
+				((sqlasync_custom_func_t)op->args[0].val.ptr)(s, s->db, op->q, op->numargs-1, op->args+1);
+				/* We have no idea what the function has done */
+				if(s->cachemax)
+					sqlasync_thread_cache_remove(s, NULL, 0);
+				s->dirtylen = 0;
+			}
 			continue;
 		}
 
+		/* The bind values are consumed by sqlasync_thread_sql(), so count them first */
+		unsigned int bytes = s->groupmaxbytes ? sqlasync_op_bytes(op) : 0;
 		sqlasync_thread_sql(s, op);
 		s->donext = (flags & SQLASYNC_SINGLE) == SQLASYNC_NEXT;
+		if(s->intrans) {
+			s->transops++;
+			s->transbytes += bytes;
+		}
 	}
-	sqlasync_op_free(op);
+	sqlasync_op_free(s, op);
 
 	sqlasync_thread_close(s);
+	sqlasync_queue_result(s->slowq, sqlasync_result_create(SQLITE_OK, 1, 0));
 	return NULL;
 }
 
@@ -793,29 +3087,21 @@ static void *sqlasync_thread(void *dat) {
 
 
 sqlasync_queue_t *sqlasync_open(sqlasync_t *s, sqlasync_queue_t *q, sqlasync_queue_t *errq, const char *filename, int flags) {
-	sqlasync_op_t *op = sqlasync_op_create(q, filename, SQLASYNC_OPEN, 2);
+	sqlasync_op_t *op = sqlasync_op_create(s, q, filename, SQLASYNC_OPEN, 2);
 	op->args[0] = sqlasync_int(flags);
 	op->args[1].freeptr = 0;
 	op->args[1].val.ptr = errq; /* Abuse the sqlasync_value_t to pass a queue pointer */
 	sqlasync_queue_schedule(q);
 	sqlasync_queue_schedule(errq);
-
-	pthread_mutex_lock(&s->lock);
-	queue_push(s, op, op);
-	pthread_cond_signal(&s->cond);
-	pthread_mutex_unlock(&s->lock);
+	sqlasync_submit(s, op, op);
 
 	return q;
 }
 
 
 void sqlasync_close(sqlasync_t *s) {
-	sqlasync_op_t *op = sqlasync_op_create(NULL, NULL, SQLASYNC_CLOSE, 0);
-
-	pthread_mutex_lock(&s->lock);
-	queue_push(s, op, op);
-	pthread_cond_signal(&s->cond);
-	pthread_mutex_unlock(&s->lock);
+	sqlasync_op_t *op = sqlasync_op_create(s, NULL, NULL, SQLASYNC_CLOSE, 0);
+	sqlasync_submit(s, op, op);
 }
 
 
@@ -823,7 +3109,16 @@ sqlasync_t *sqlasync_create(const struct timespec *transtimeout) {
 	sqlasync_t *s = calloc(1, sizeof(sqlasync_t));
 	if(transtimeout)
 		s->transtimeout = *transtimeout;
+	s->busymin = 1;
+	s->busymax = 100;
+	s->busyseed = time(NULL) ^ (unsigned int)(size_t)s;
 	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->statslock, NULL);
+	pthread_mutex_init(&s->waitlock, NULL);
+	pthread_mutex_init(&s->internlock, NULL);
+	pthread_mutex_init(&s->ckptlock, NULL);
+	pthread_mutex_init(&s->cachelock, NULL);
+	pthread_cond_init(&s->ckptcond, NULL);
 
 	/* COMPAT: We unconditionally use CLOCK_MONOTONIC in order to avoid
 	 * problems when the system time jumps. However,
@@ -845,22 +3140,211 @@ sqlasync_t *sqlasync_create(const struct timespec *transtimeout) {
 }
 
 
-void sqlasync_lock(sqlasync_t *s)   { pthread_mutex_lock(&s->lock);   }
-void sqlasync_unlock(sqlasync_t *s) { pthread_mutex_unlock(&s->lock); }
+sqlasync_t *sqlasync_group(sqlasync_t *s, unsigned int maxops, unsigned int maxbytes, int flags) {
+	/* Should be called before the first query, so no need to lock here */
+	s->groupmaxops = maxops;
+	s->groupmaxbytes = maxbytes;
+	s->groupflags = flags;
+	s->groupops = maxops;
+	if(flags & SQLASYNC_GROUP_ADAPTIVE) {
+		if(!s->groupmaxops)
+			s->groupmaxops = UINT_MAX;
+		s->groupops = s->groupmaxops < 64 ? s->groupmaxops : 64;
+	}
+	return s;
+}
 
 
-sqlasync_queue_t *sqlasync_sqlv_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+static const sqlasync_tuning_t sqlasync_presets[] = {
+	{ "throughput", "WAL", "NORMAL", "-65536", "268435456", "MEMORY", NULL },
+	{ "durable",    "WAL", "FULL",   NULL,     NULL,        NULL,     NULL },
+};
+
+
+const sqlasync_tuning_t *sqlasync_tuning_preset(const char *name) {
+	size_t i;
+	for(i=0; i<sizeof(sqlasync_presets)/sizeof(*sqlasync_presets); i++)
+		if(strcmp(sqlasync_presets[i].name, name) == 0)
+			return sqlasync_presets+i;
+	return NULL;
+}
+
+
+sqlasync_t *sqlasync_tune(sqlasync_t *s, const sqlasync_tuning_t *t) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	sqlite3_free(s->tunesql);
+	s->tunesql = NULL;
+	if(!t)
+		return s;
+
+	/* page_size has to come first, it can't be changed after the database
+	 * has been put in WAL mode. */
+	const char *names[] = { "page_size", "journal_mode", "synchronous", "cache_size", "mmap_size", "temp_store" };
+	const char *values[] = { t->page_size, t->journal_mode, t->synchronous, t->cache_size, t->mmap_size, t->temp_store };
+	size_t i;
+	for(i=0; i<sizeof(names)/sizeof(*names); i++)
+		if(values[i])
+			s->tunesql = sqlite3_mprintf("%zPRAGMA %s=%s;", s->tunesql, names[i], values[i]);
+	return s;
+}
+
+
+sqlasync_t *sqlasync_cache(sqlasync_t *s, size_t maxmem) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	s->cachemax = maxmem;
+	return s;
+}
+
+
+sqlasync_t *sqlasync_checkpoint(sqlasync_t *s, unsigned int maxwal, int mode) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	s->ckptenabled = 1;
+	s->ckptmaxwal = maxwal;
+	s->ckptmode = mode;
+	return s;
+}
+
+
+sqlasync_t *sqlasync_persist(sqlasync_t *s, unsigned int interval) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	s->persist.enabled = 1;
+	s->persist.interval.tv_sec = interval / 1000;
+	s->persist.interval.tv_nsec = (interval % 1000) * 1000000;
+	return s;
+}
+
+
+sqlasync_t *sqlasync_busy(sqlasync_t *s, unsigned int minwait, unsigned int maxwait, unsigned int timeout) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	s->busymin = minwait ? minwait : 1;
+	s->busymax = maxwait > s->busymin ? maxwait : s->busymin;
+	s->busytimeout = timeout;
+	return s;
+}
+
+
+void sqlasync_instrument(sqlasync_t *s, sqlasync_instrument_func_t func, void *data) {
+	/* Should be called before sqlasync_open(), so no need to lock here */
+	s->instrumentfunc = func;
+	s->instrumentdata = data;
+	s->instrumented = 1;
+}
+
+
+sqlasync_queue_t *sqlasync_slowlog(sqlasync_t *s, sqlasync_queue_t *q, unsigned int threshold) {
+	sqlasync_queue_schedule(q);
+	s->slowq = q;
+	s->slowtime = threshold;
+	s->instrumented = 1;
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_querystats(sqlasync_t *s, sqlasync_queue_t *q) {
+	return sqlasync_custom(s, q, sqlasync_thread_querystats, 0);
+}
+
+
+void sqlasync_stats(sqlasync_t *s, sqlasync_stats_t *stats) {
+	pthread_mutex_lock(&s->statslock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->statslock);
+}
+
+
+const char *sqlasync_intern(sqlasync_t *s, const char *query) {
+	sqlasync_intern_t *in;
+	pthread_mutex_lock(&s->internlock);
+	for(in=s->interned; in; in=in->next)
+		if(strcmp(in->str, query) == 0)
+			break;
+	if(!in) {
+		in = malloc(offsetof(sqlasync_intern_t, str) + strlen(query) + 1);
+		in->st = NULL;
+		strcpy(in->str, query);
+		in->next = s->interned;
+		s->interned = in;
+	}
+	pthread_mutex_unlock(&s->internlock);
+	return in->str;
+}
+
+
+void sqlasync_lock(sqlasync_t *s) {
+	pthread_mutex_lock(&s->lock);
+}
+
+
+void sqlasync_unlock(sqlasync_t *s) {
+	sqlasync_op_t *f = s->chain.first, *l = s->chain.last;
+	s->chain.first = s->chain.last = NULL;
+	pthread_mutex_unlock(&s->lock);
+	if(f)
+		sqlasync_submit(s, f, l);
+}
+
+
+static sqlasync_op_t *sqlasync_sqlv_create(sqlasync_t *s, sqlasync_queue_t *q,
 		int flags, const char *query, int bind_num, va_list binds) {
-	sqlasync_op_t *op = sqlasync_op_create(q, query, flags, bind_num);
+	sqlasync_op_t *op = sqlasync_op_create(s, q, query, flags, bind_num);
 
 	int i = 0;
 	while(i<bind_num)
 		op->args[i++] = va_arg(binds, sqlasync_value_t);
 
 	sqlasync_queue_schedule(q);
-	queue_push(s, op, op);
-	pthread_cond_signal(&s->cond);
+	return op;
+}
+
+
+static sqlasync_op_t *sqlasync_many_create(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const char *query, int ncols, int nrows, const sqlasync_value_t *values) {
+	sqlasync_op_t *op = sqlasync_op_create(s, q, query, flags|SQLASYNC_MANY, 1+(ncols*nrows));
+	op->args[0] = sqlasync_int(nrows);
+	memcpy(op->args+1, values, ncols*nrows*sizeof(sqlasync_value_t));
+
+	sqlasync_queue_schedule(q);
+	return op;
+}
+
+
+static sqlasync_op_t *sqlasync_layout_create(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const sqlasync_layout_t *layout, unsigned int batch, const char *query, int bind_num, va_list binds) {
+	sqlasync_op_t *op = sqlasync_op_create(s, q, query, flags|SQLASYNC_LAYOUT, bind_num+2);
+	op->args[0].freeptr = 0;
+	op->args[0].val.ptr = (void *)layout;
+	op->args[1] = sqlasync_int(batch ? batch : 1);
+
+	int i = 0;
+	while(i<bind_num)
+		op->args[2+i++] = va_arg(binds, sqlasync_value_t);
+
+	sqlasync_queue_schedule(q);
+	return op;
+}
+
+
+static sqlasync_op_t *sqlasync_visit_create(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, sqlasync_visit_func_t func, void *data, const char *query, int bind_num, va_list binds) {
+	sqlasync_op_t *op = sqlasync_op_create(s, q, query, flags|SQLASYNC_VISIT, bind_num+2);
+	op->args[0].freeptr = 0;
+	op->args[0].val.ptr = (void *)func;
+	op->args[1].freeptr = 0;
+	op->args[1].val.ptr = data;
+
+	int i = 0;
+	while(i<bind_num)
+		op->args[2+i++] = va_arg(binds, sqlasync_value_t);
+
+	sqlasync_queue_schedule(q);
+	return op;
+}
+
 
+sqlasync_queue_t *sqlasync_sqlv_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const char *query, int bind_num, va_list binds) {
+	sqlasync_op_t *op = sqlasync_sqlv_create(s, q, flags, query, bind_num, binds);
+	queue_push(&s->chain, op, op);
 	return q;
 }
 
@@ -875,21 +3359,119 @@ sqlasync_queue_t *sqlasync_sql_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
 }
 
 
+/* Serves a query from the cache if possible, submits it otherwise. A query
+ * with earlier queries pending on its queue is always submitted, a cache hit
+ * would overtake their results. */
+static void sqlasync_sql_submit(sqlasync_t *s, sqlasync_queue_t *q, int flags, sqlasync_op_t *op) {
+	if((flags & SQLASYNC_CACHE) && s->cachemax &&
+			((flags & SQLASYNC_SINGLE) == 0 || (flags & SQLASYNC_SINGLE) == SQLASYNC_SINGLE) &&
+			(!q || sqlasync_queue_idle(q)) && sqlasync_cache_get(s, q, op))
+		sqlasync_op_free(s, op);
+	else
+		sqlasync_submit(s, op, op);
+}
+
+
 sqlasync_queue_t *sqlasync_sql(sqlasync_t *s, sqlasync_queue_t *q,
 		int flags, const char *query, int bind_num, ...) {
 	va_list l;
 	va_start(l, bind_num);
-	sqlasync_lock(s);
-	sqlasync_queue_t *rq = sqlasync_sqlv_unlocked(s, q, flags, query, bind_num, l);
-	sqlasync_unlock(s);
+	sqlasync_op_t *op = sqlasync_sqlv_create(s, q, flags, query, bind_num, l);
 	va_end(l);
-	return rq;
+	sqlasync_sql_submit(s, q, flags, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_deadline_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const struct timespec *deadline, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_sqlv_create(s, q, flags, query, bind_num, l);
+	va_end(l);
+	if(deadline)
+		op->deadline = *deadline;
+	queue_push(&s->chain, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_deadline(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const struct timespec *deadline, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_sqlv_create(s, q, flags, query, bind_num, l);
+	va_end(l);
+	if(deadline)
+		op->deadline = *deadline;
+	sqlasync_sql_submit(s, q, flags, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_many_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const char *query, int ncols, int nrows, const sqlasync_value_t *values) {
+	sqlasync_op_t *op = sqlasync_many_create(s, q, flags, query, ncols, nrows, values);
+	queue_push(&s->chain, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_many(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const char *query, int ncols, int nrows, const sqlasync_value_t *values) {
+	sqlasync_op_t *op = sqlasync_many_create(s, q, flags, query, ncols, nrows, values);
+	sqlasync_submit(s, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_layout_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const sqlasync_layout_t *layout, unsigned int batch, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_layout_create(s, q, flags, layout, batch, query, bind_num, l);
+	va_end(l);
+	queue_push(&s->chain, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_layout(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const sqlasync_layout_t *layout, unsigned int batch, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_layout_create(s, q, flags, layout, batch, query, bind_num, l);
+	va_end(l);
+	sqlasync_submit(s, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_visit_unlocked(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, sqlasync_visit_func_t func, void *data, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_visit_create(s, q, flags, func, data, query, bind_num, l);
+	va_end(l);
+	queue_push(&s->chain, op, op);
+	return q;
+}
+
+
+sqlasync_queue_t *sqlasync_sql_visit(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, sqlasync_visit_func_t func, void *data, const char *query, int bind_num, ...) {
+	va_list l;
+	va_start(l, bind_num);
+	sqlasync_op_t *op = sqlasync_visit_create(s, q, flags, func, data, query, bind_num, l);
+	va_end(l);
+	sqlasync_submit(s, op, op);
+	return q;
 }
 
 
 sqlasync_queue_t *sqlasync_custom(sqlasync_t *s, sqlasync_queue_t *q, sqlasync_custom_func_t f, int val_num, ...) {
 	va_list l;
-	sqlasync_op_t *op = sqlasync_op_create(q, NULL, SQLASYNC_CUSTOM, val_num+1);
+	sqlasync_op_t *op = sqlasync_op_create(s, q, NULL, SQLASYNC_CUSTOM, val_num+1);
 	op->args[0].freeptr = 0;
 	op->args[0].val.ptr = f;
 
@@ -898,29 +3480,221 @@ sqlasync_queue_t *sqlasync_custom(sqlasync_t *s, sqlasync_queue_t *q, sqlasync_c
 	while(i<val_num)
 		op->args[++i] = va_arg(l, sqlasync_value_t);
 
-	sqlasync_lock(s);
+	va_end(l);
+
 	sqlasync_queue_schedule(q);
-	queue_push(s, op, op);
-	pthread_cond_signal(&s->cond);
-	sqlasync_unlock(s);
+	sqlasync_submit(s, op, op);
 
-	va_end(l);
 	return q;
 }
 
 
-void sqlasync_destroy(sqlasync_t *s) {
-	sqlasync_op_t *op = sqlasync_op_create(NULL, NULL, SQLASYNC_QUIT, 0);
+sqlasync_queue_t *sqlasync_backup(sqlasync_t *s, sqlasync_queue_t *q, const char *dest, int pages, unsigned int pause) {
+	sqlasync_op_t *op = sqlasync_op_create(s, q, dest, SQLASYNC_BACKUP, 2);
+	op->args[0] = sqlasync_int(pages);
+	op->args[1] = sqlasync_int(pause);
+	sqlasync_queue_schedule(q);
+	sqlasync_submit(s, op, op);
+	return q;
+}
 
-	pthread_mutex_lock(&s->lock);
-	queue_push(s, op, op);
-	pthread_cond_signal(&s->cond);
-	pthread_mutex_unlock(&s->lock);
+
+sqlasync_queue_t *sqlasync_subscribe(sqlasync_t *s, sqlasync_queue_t *q, const char *const *tables) {
+	int n = 0, i;
+	while(tables && tables[n])
+		n++;
+	sqlasync_op_t *op = sqlasync_op_create(s, q, NULL, SQLASYNC_SUBSCRIBE, n);
+	for(i=0; i<n; i++)
+		op->args[i] = sqlasync_text(SQLASYNC_COPY, tables[i]);
+	sqlasync_queue_schedule(q);
+	sqlasync_submit(s, op, op);
+	return q;
+}
+
+
+void sqlasync_unsubscribe(sqlasync_t *s, sqlasync_queue_t *q) {
+	sqlasync_op_t *op = sqlasync_op_create(s, q, NULL, SQLASYNC_UNSUBSCRIBE, 0);
+	sqlasync_submit(s, op, op);
+}
+
+
+sqlasync_cursor_t *sqlasync_cursor_open(sqlasync_t *s, sqlasync_queue_t *q,
+		int flags, const char *query, int bind_num, ...) {
+	assert(q != NULL);
+	sqlasync_cursor_t *c = calloc(1, sizeof(sqlasync_cursor_t));
+	c->q = q;
+
+	va_list l;
+	sqlasync_op_t *op = sqlasync_op_create(s, q, query, (flags & (3|SQLASYNC_PRIO)) | SQLASYNC_CURSOR_OPEN, bind_num+1);
+	op->args[0].freeptr = 0;
+	op->args[0].val.ptr = c;
+
+	int i = 0;
+	va_start(l, bind_num);
+	while(i<bind_num)
+		op->args[++i] = va_arg(l, sqlasync_value_t);
+	va_end(l);
+
+	sqlasync_queue_schedule(q);
+	sqlasync_submit(s, op, op);
+	return c;
+}
+
+
+void sqlasync_cursor_next(sqlasync_t *s, sqlasync_cursor_t *c, unsigned int n) {
+	sqlasync_op_t *op = sqlasync_op_create(s, c->q, NULL, SQLASYNC_CURSOR_NEXT, 2);
+	op->args[0].freeptr = 0;
+	op->args[0].val.ptr = c;
+	op->args[1] = sqlasync_int(n);
+
+	sqlasync_queue_schedule(c->q);
+	sqlasync_submit(s, op, op);
+}
+
+
+void sqlasync_cursor_close(sqlasync_t *s, sqlasync_cursor_t *c) {
+	/* No results, so don't associate the operation with the queue */
+	sqlasync_op_t *op = sqlasync_op_create(s, NULL, NULL, SQLASYNC_CURSOR_CLOSE, 1);
+	op->args[0].freeptr = 0;
+	op->args[0].val.ptr = c;
+	sqlasync_submit(s, op, op);
+}
+
+
+void sqlasync_destroy(sqlasync_t *s) {
+	sqlasync_op_t *op = sqlasync_op_create(s, NULL, NULL, SQLASYNC_QUIT, 0);
+	sqlasync_submit(s, op, op);
 
 	pthread_join(s->thread, NULL);
 	pthread_mutex_destroy(&s->lock);
+	pthread_mutex_destroy(&s->waitlock);
+	pthread_mutex_destroy(&s->internlock);
+	pthread_mutex_destroy(&s->statslock);
+	pthread_mutex_destroy(&s->ckptlock);
+	pthread_mutex_destroy(&s->cachelock);
 	pthread_cond_destroy(&s->cond);
+	pthread_cond_destroy(&s->ckptcond);
+
+	while(s->cursors) {
+		sqlasync_cursor_t *c = s->cursors;
+		s->cursors = c->next;
+		free(c);
+	}
+
+	unsigned int b;
+	for(b=0; b<SQLASYNC_POOL_BUCKETS; b++)
+		while(s->pool[b]) {
+			op = s->pool[b];
+			s->pool[b] = op->next;
+			free(op);
+		}
+	while(s->interned) {
+		sqlasync_intern_t *in = s->interned;
+		s->interned = in->next;
+		free(in);
+	}
+	for(b=0; b<SQLASYNC_QSTAT_BUCKETS; b++)
+		while(s->qstats[b]) {
+			sqlasync_qstat_t *qs = s->qstats[b];
+			s->qstats[b] = qs->next;
+			free(qs);
+		}
+	while(s->lrufirst) {
+		sqlasync_centry_t *e = s->lrufirst;
+		s->lrufirst = e->lnext;
+		sqlasync_cache_free(e);
+	}
+	free(s->captables);
+	free(s->dirty);
+	sqlite3_free(s->tunesql);
+	free(s->cdc);
+	free(s->cdcnames);
+	free(s->cdcsp);
 	free(s);
 }
 
+
+struct sqlasync_router_t {
+	unsigned int num;
+	sqlasync_t *shards[];
+};
+
+
+sqlasync_router_t *sqlasync_router_create(unsigned int num, const struct timespec *transtimeout) {
+	assert("A router needs at least one shard" && num > 0);
+	sqlasync_router_t *r = calloc(1, offsetof(sqlasync_router_t, shards) + num*sizeof(sqlasync_t *));
+	for(r->num=0; r->num<num; r->num++)
+		if(!(r->shards[r->num] = sqlasync_create(transtimeout))) {
+			sqlasync_router_destroy(r);
+			return NULL;
+		}
+	return r;
+}
+
+
+sqlasync_t *sqlasync_router_shard(sqlasync_router_t *r, unsigned int i) {
+	return i < r->num ? r->shards[i] : NULL;
+}
+
+
+sqlasync_t *sqlasync_router_route(sqlasync_router_t *r, unsigned int hash) {
+	return r->shards[hash % r->num];
+}
+
+
+/* Returns a copy of a bind value that doesn't share its buffer */
+static sqlasync_value_t sqlasync_value_dup(sqlasync_value_t v) {
+	if(v.freeptr && v.type == SQLITE3_TEXT)
+		return sqlasync_text(SQLASYNC_COPY, v.val.ptr);
+	if(v.freeptr && v.type == SQLITE_BLOB)
+		return sqlasync_blob(SQLASYNC_COPY, v.length, v.val.ptr);
+	return v;
+}
+
+
+sqlasync_queue_t *sqlasync_router_all(sqlasync_router_t *r, sqlasync_queue_t *q,
+		int flags, const char *query, int bind_num, ...) {
+	assert("Interned queries can't be used on multiple shards" && sqlasync_bufmanage(flags) != SQLASYNC_INTERNED);
+	unsigned int i;
+	int j;
+
+	sqlasync_queue_t *m = NULL;
+	if(q) {
+		m = sqlasync_queue_sync();
+		m->target = q;
+		m->pending = r->num;
+		m->timeout = q->timeout;
+		sqlasync_queue_schedule(q);
+	}
+
+	va_list l;
+	sqlasync_value_t *binds = malloc(bind_num*sizeof(sqlasync_value_t));
+	va_start(l, bind_num);
+	for(j=0; j<bind_num; j++)
+		binds[j] = va_arg(l, sqlasync_value_t);
+	va_end(l);
+
+	/* The original query and bind values are given to the last shard, the
+	 * other shards get their own copy of anything that will be freed. */
+	for(i=0; i<r->num; i++) {
+		int last = i == r->num-1;
+		int f = !last && sqlasync_bufmanage(flags) == SQLASYNC_FREE ? (flags & ~3) | SQLASYNC_COPY : flags;
+		sqlasync_op_t *op = sqlasync_op_create(r->shards[i], m, query, f, bind_num);
+		for(j=0; j<bind_num; j++)
+			op->args[j] = last ? binds[j] : sqlasync_value_dup(binds[j]);
+		sqlasync_submit(r->shards[i], op, op);
+	}
+
+	free(binds);
+	return q;
+}
+
+
+void sqlasync_router_destroy(sqlasync_router_t *r) {
+	unsigned int i;
+	for(i=0; i<r->num; i++)
+		sqlasync_destroy(r->shards[i]);
+	free(r);
+}
+
 /* vim: set noet sw=4 ts=4: */
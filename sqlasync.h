@@ -35,7 +35,7 @@
  * Patches to relax any of these requirements are of course welcome.
  *
  * TODO:
- * - Cache prepared statements
+ * - Cache prepared statements of queries that have not been interned
  * - Don't create query results if the application has specified a NULL result
  *   queue or has called sqlasync_queue_destroy().
  * - Separate the result queue handling abstraction into a different library?
@@ -47,6 +47,7 @@
 #define SQLASYNC_H
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
@@ -66,12 +67,77 @@ typedef enum {
 	/* The buffer is assumed to stay alive and unmodified for as long as it is
 	 * referenced. Note that the application usually has no idea how long that
 	 * is, so this makes most sense for static strings and the like. */
-	SQLASYNC_STATIC = 2
+	SQLASYNC_STATIC = 2,
+	/* The buffer has been obtained from sqlasync_intern(). This flag can only
+	 * be used for SQL queries. */
+	SQLASYNC_INTERNED = 3
 } sqlasync_bufmanage_t;
 
 typedef struct sqlasync_t sqlasync_t;
 
 
+/* Statistics of a database thread, see sqlasync_stats(). All times are in
+ * microseconds. */
+typedef struct {
+	/* Number of times the database thread has waited for a lock */
+	unsigned long long busy_retries;
+	/* Total time spent waiting for locks */
+	unsigned long long busy_wait;
+	/* Number of times the busy timeout has been exceeded */
+	unsigned long long busy_timeouts;
+	/* Number of COMMITs and the total time spent in them */
+	unsigned long long commits;
+	unsigned long long commit_time;
+	/* Number of queries aborted because their deadline had passed, see
+	 * sqlasync_queue_timeout() */
+	unsigned long long expired;
+	/* Number of background checkpoints, the total time spent in them, and
+	 * how many of those have been successfully escalated. See
+	 * sqlasync_checkpoint(). */
+	unsigned long long checkpoints;
+	unsigned long long checkpoint_time;
+	unsigned long long checkpoint_escalations;
+	/* Size of the WAL in pages, as seen by the last checkpoint */
+	unsigned long long wal_size;
+	/* Result cache statistics, see sqlasync_cache(). The number of
+	 * SQLASYNC_CACHE queries that have been served from the cache and that
+	 * had to be queued, and the number of entries that have been removed
+	 * because of the memory limit or because their tables were modified. */
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	unsigned long long cache_evictions;
+	unsigned long long cache_invalidations;
+	/* The following are only updated when instrumentation is enabled, see
+	 * sqlasync_instrument(). Number of executed queries, the total time they
+	 * spent waiting in the queue and executing, the total number of rows
+	 * returned and the number of queries logged by sqlasync_slowlog(). */
+	unsigned long long ops;
+	unsigned long long queue_time;
+	unsigned long long exec_time;
+	unsigned long long rows;
+	unsigned long long slow_queries;
+} sqlasync_stats_t;
+
+
+/* Statistics of a single query, passed to the instrumentation callback. The
+ * timestamps are taken from CLOCK_MONOTONIC. The SQLite counters are only
+ * available if the query has been successfully prepared, vm_steps requires
+ * SQLite 3.20.0 or later. */
+typedef struct {
+	const char *query;
+	int result;
+	struct timespec queued;   /* Time when sqlasync_sql() (or similar) was called */
+	struct timespec started;  /* Time when the database thread started executing the query */
+	struct timespec finished; /* Time when the `last' result was queued */
+	unsigned int rows;        /* Number of SQLITE_ROW results */
+	unsigned int fullscan_steps; /* SQLITE_STMTSTATUS_FULLSCAN_STEP */
+	unsigned int sorts;       /* SQLITE_STMTSTATUS_SORT */
+	unsigned int vm_steps;    /* SQLITE_STMTSTATUS_VM_STEP */
+} sqlasync_opstat_t;
+
+typedef void(*sqlasync_instrument_func_t)(sqlasync_t *sql, const sqlasync_opstat_t *stat, void *data);
+
+
 
 
 /* Generic SQLite value, used for query binding and passing back query results.
@@ -149,8 +215,9 @@ typedef void(*sqlasync_wakeup_func_t)(sqlasync_wakeup_t *wakeup, void *data);
  * sqlasync_dispatch() in the near future (e.g. next event loop iteration). The
  * callback will be called only once when there is stuff to dispatch. It will
  * not be called again until after sqlasync_dispatch() has returned. The
- * callback will be run from the context of the database thread or from
- * sqlasync_queue_get() [1]. It should not call any sqlasync_ functions itself.
+ * callback will be run from the context of the database thread, from
+ * sqlasync_queue_get() [1] or from sqlasync_sql() [2]. It should not call any
+ * sqlasync_ functions itself.
  *
  * The schedule callback will be called to indicate that something has been
  * scheduled, before the wakeup callback is called. This can be useful for
@@ -166,6 +233,7 @@ typedef void(*sqlasync_wakeup_func_t)(sqlasync_wakeup_t *wakeup, void *data);
  *
  * 1. Only when sqlasync_queue_get() is called from outside of a result
  *    callback and it returned the last result scheduled for the wakeup object.
+ * 2. Only when the result of a SQLASYNC_CACHE query is served from the cache.
  */
 sqlasync_wakeup_t *sqlasync_wakeup_create(sqlasync_wakeup_func_t wakeup, sqlasync_wakeup_func_t schedule, void *data);
 
@@ -174,10 +242,37 @@ sqlasync_wakeup_t *sqlasync_wakeup_create(sqlasync_wakeup_func_t wakeup, sqlasyn
  * been scheduled for this wakeup object. */
 void sqlasync_wakeup_destroy(sqlasync_wakeup_t *wakeup);
 
+/* Returns the `data' argument given to sqlasync_wakeup_create(). */
+void *sqlasync_wakeup_data(sqlasync_wakeup_t *wakeup);
+
 /* Should be called after receiving the wakeup callback. This function will in
- * turn invoke callbacks registered with sqlasync_queue_async(). */
+ * turn invoke callbacks registered with sqlasync_queue_async(). Queues with
+ * results available take turns: each callback invocation moves its queue to
+ * the back of the line, so a query streaming many rows to an `each' queue does
+ * not hold up the results of other queries.
+ *
+ * Without a budget, this function keeps invoking callbacks until no more
+ * results are available. If the budget set with sqlasync_wakeup_budget() runs
+ * out first, it returns early and the wakeup callback is invoked again (from
+ * this function) to schedule another call. */
 void sqlasync_dispatch(sqlasync_wakeup_t *wakeup);
 
+/* Limit the amount of work done by a single sqlasync_dispatch() call to
+ * `results' results and `usec' microseconds, whichever comes first. A value of
+ * 0 means unlimited, which is the default for both.
+ *
+ * The result limit counts the results taken with sqlasync_queue_get() from
+ * the callbacks. Once it is reached, sqlasync_queue_get() returns NULL for the
+ * rest of the dispatch, even if more results are available; the callback of
+ * that queue is invoked again on the next dispatch. Note that this also
+ * applies to queues created with `each' set to 0, so with a result budget a
+ * callback may not be able to read all results of a query in one go.
+ *
+ * At least one callback is invoked per dispatch, even if it takes longer than
+ * `usec'. The time limit is checked between callbacks, a single slow callback
+ * is not interrupted. */
+void sqlasync_wakeup_budget(sqlasync_wakeup_t *wakeup, unsigned int results, unsigned int usec);
+
 
 
 
@@ -191,7 +286,12 @@ void sqlasync_dispatch(sqlasync_wakeup_t *wakeup);
  * always returned in FIFO order; If you use sqlasync_sql() twice with the same
  * queue, the results of the first query are given first, followed by the
  * results on the second query. The `last' field functions as a separator
- * between the results of different queries.
+ * between the results of different queries. This includes queries served from
+ * the result cache (see sqlasync_cache()): A cache hit is only passed back
+ * right away when no earlier query on the same queue is still pending,
+ * otherwise the query is executed in order as usual. Results passed to a queue
+ * by a sqlasync_custom() function are the exception, those are added to the
+ * queue as soon as the function passes them.
  *
  * A single result queue can only be used with a single sqlasync_t object at a
  * time. You must ensure that all results have been consumed from the queue
@@ -252,10 +352,25 @@ sqlasync_queue_t *sqlasync_queue_async(sqlasync_wakeup_t *wakeup, int each, sqla
  * thread will not be able to process further queries and may in turn cause a
  * deadlock situation. Similarly, using this function on an async queue with
  * `each' set to 0 will result in a deadlock if more than this number of
- * results are queued as part of a single query.
+ * results are queued as part of a single query. Use a cursor for queries that
+ * may return more results than the application can buffer.
  */
 sqlasync_queue_t *sqlasync_queue_buffersize(sqlasync_queue_t *q, unsigned int len);
 
+/* Set a deadline for queries queued for this queue. The deadline of a query is
+ * the time of queueing plus the given timeout. Use sqlasync_sql_deadline() to
+ * give a single query a deadline of its own. A query that is still waiting
+ * in the queue when its deadline passes is answered without touching the
+ * database, and a query that is still running at that point is interrupted.
+ * In both cases, the result is a SQLITE_INTERRUPT error with the `last' flag
+ * set, handled in the same way as with sqlasync_cancel().
+ *
+ * Like sqlasync_queue_buffersize(), this function should not be called while
+ * other threads may be queueing queries for this queue. A NULL or zero timeout
+ * disables the deadline (default). Returns the given queue.
+ */
+sqlasync_queue_t *sqlasync_queue_timeout(sqlasync_queue_t *q, const struct timespec *timeout);
+
 /* Get a result from the queue. The behaviour of this function when the queue
  * is empty depends on how the queue was created.
  *
@@ -264,12 +379,54 @@ sqlasync_queue_t *sqlasync_queue_buffersize(sqlasync_queue_t *q, unsigned int le
  *
  * If it was created with sqlasync_queue_async(), then this function will
  * always return immediately. NULL is returned if no results are available at
- * this moment.
+ * this moment, or if the result budget of the current sqlasync_dispatch() has
+ * been spent (see sqlasync_wakeup_budget()).
  *
  * The returned object should be freed with sqlasync_result_free().
  */
 sqlasync_result_t *sqlasync_queue_get(sqlasync_queue_t *q);
 
+/* Like sqlasync_queue_get(), but never blocks. Returns NULL if no result is
+ * available. */
+sqlasync_result_t *sqlasync_queue_tryget(sqlasync_queue_t *q);
+
+/* Take up to `max' results from a sync queue in one go, storing them in `res'
+ * in the order they were queued. If the queue is empty, this function waits
+ * for at most `timeout' milliseconds for a result to become available, or
+ * indefinitely if `timeout' is negative. Returns the number of results stored,
+ * 0 if the timeout expired. Each result should be freed with
+ * sqlasync_result_free(). */
+int sqlasync_queue_getn(sqlasync_queue_t *q, sqlasync_result_t **res, int max, int timeout);
+
+/* Returns a file descriptor that is readable while a sync queue has results
+ * available, for use with poll(), epoll or an event loop. The descriptor
+ * should not be read from or closed by the application, it is closed when
+ * the queue is freed. Returns -1 if the descriptor could not be created.
+ *
+ * The descriptor is a pipe rather than an eventfd, for portability. It is
+ * created on the first call, queues that don't use it don't pay for the extra
+ * system calls. */
+int sqlasync_queue_fd(sqlasync_queue_t *q);
+
+/* Cancel all queries that have been queued for this queue so far. Queries
+ * that haven't been started yet are answered without touching the database,
+ * and a query that is currently running is interrupted. Either way, the
+ * cancelled query results in a SQLITE_INTERRUPT error with the `last' flag
+ * set. Any rows that had already been returned by an interrupted query remain
+ * in the queue. Queries queued after this call are not affected.
+ *
+ * Queries queued with sqlasync_custom() are skipped if they haven't been
+ * started yet, but are not interrupted.
+ *
+ * A cancelled query is handled as a failed query: If it is part of a NEXT
+ * chain, the transaction is rolled back. Within a grouped transaction (see
+ * sqlasync_create()), only the changes of the cancelled query are rolled back.
+ *
+ * sqlasync_queue_destroy() does not imply a cancel, call this function first
+ * if you're not interested in the queries anymore.
+ * This function may be called from any thread. */
+void sqlasync_cancel(sqlasync_queue_t *q);
+
 /* Discard any (old or new) results and free the queue. */
 void sqlasync_queue_destroy(sqlasync_queue_t *q);
 
@@ -306,17 +463,231 @@ void sqlasync_result_free(sqlasync_result_t *res);
  *   application crashes or otherwise doesn't shut down orderly, any
  *   modifications before the last flush will be lost.
  * - A transaction may be flushed before the timeout expired. This happens when
- *   the database is closed or when a query with the SQLASYNC_LAST or
- *   SQLASYNC_SINGLE flag is processed.
+ *   the database is closed, when a query with the SQLASYNC_LAST or
+ *   SQLASYNC_SINGLE flag is processed, or when one of the conditions
+ *   configured with sqlasync_group() is met.
  * - Since the actual database modifications for a query are deferred, such
  *   modifications may be lost even if the query resulted in an
  *   SQLITE_OK/SQLITE_DONE. Errors when committing such a transaction are
- *   reported on the queue given to sqlasync_open().
- * - If one query fails with an error while a transaction is active, the entire
- *   transaction will be rolled back and any modifications will be lost.
+ *   reported on the queue given to sqlasync_open(). Use the SQLASYNC_DURABLE
+ *   flag to get the result of a query only after it has been committed.
+ * - Each query (or SQLASYNC_NEXT chain) is executed within a SAVEPOINT. If
+ *   it fails with an error, only its own modifications are rolled back, the
+ *   transaction itself remains active. An exception are errors that cause
+ *   SQLite to abort the entire transaction, such as SQLITE_FULL, SQLITE_IOERR
+ *   or SQLITE_NOMEM. All modifications in the transaction are lost in that
+ *   case.
  */
 sqlasync_t *sqlasync_create(const struct timespec *transtimeout);
 
+/* Flags for sqlasync_group() */
+typedef enum {
+	/* Commit as soon as there are no more queries waiting to be processed. */
+	SQLASYNC_GROUP_IDLE = 1,
+	/* Automatically tune the operation limit based on measured COMMIT times. */
+	SQLASYNC_GROUP_ADAPTIVE = 2
+} sqlasync_group_flags_t;
+
+/* Configure when a grouped transaction is committed. This only has an effect
+ * if a transtimeout has been given to sqlasync_create(). A transaction is then
+ * committed when any of the following conditions is met:
+ * - The transtimeout has expired;
+ * - `maxops' queries have been executed in the transaction;
+ * - The bind values of the queries in the transaction total `maxbytes' bytes;
+ * - There are no more queries waiting to be processed, if the
+ *   SQLASYNC_GROUP_IDLE flag is given.
+ * A value of 0 for `maxops' or `maxbytes' means no limit. Transactions are
+ * never split in the middle of an SQLASYNC_NEXT chain, and an
+ * sqlasync_sql_many() call counts as a single query.
+ *
+ * With SQLASYNC_GROUP_IDLE, a query that arrives during a quiet period is
+ * committed right away, whereas queries arriving during a burst are grouped
+ * together. The transtimeout then only serves as an upper bound on how long
+ * modifications may remain uncommitted.
+ *
+ * If the SQLASYNC_GROUP_ADAPTIVE flag is given, `maxops' is the upper limit
+ * of an operation limit that is tuned automatically: It is doubled when a
+ * COMMIT takes longer than executing the queries in the transaction, and
+ * halved when it takes less than a quarter of that time.
+ *
+ * This function should be called before sqlasync_open(). By default there
+ * are no limits other than the transtimeout. */
+sqlasync_t *sqlasync_group(sqlasync_t *sql, unsigned int maxops, unsigned int maxbytes, int flags);
+
+/* Configure how the database thread handles a database that is locked by
+ * another connection. The database thread will wait `minwait' milliseconds
+ * before retrying, doubling this time after each attempt until `maxwait' has
+ * been reached. The actual wait time is randomized between half and the full
+ * time, in order to avoid multiple processes retrying at the same moment. If
+ * the lock could not be obtained after waiting for `timeout' milliseconds,
+ * the operation fails with SQLITE_BUSY. A `timeout' of 0 means that the
+ * database thread will wait indefinitely.
+ *
+ * Failing with SQLITE_BUSY is reported in the same way as any other error:
+ * Normally as the result of the query, but an automatic COMMIT that fails is
+ * reported on the second queue given to sqlasync_open().
+ *
+ * This function should be called before sqlasync_open(). The default is
+ * minwait = 1, maxwait = 100 and timeout = 0. */
+sqlasync_t *sqlasync_busy(sqlasync_t *sql, unsigned int minwait, unsigned int maxwait, unsigned int timeout);
+
+/* Connection tuning, applied with sqlasync_tune(). Each field is the value of
+ * the PRAGMA of the same name, passed as-is to SQLite, or NULL to leave the
+ * setting at its default. */
+typedef struct {
+	const char *name; /* Name of the preset, unused by sqlasync_tune() */
+	const char *journal_mode;
+	const char *synchronous;
+	const char *cache_size;
+	const char *mmap_size;
+	const char *temp_store;
+	const char *page_size;
+} sqlasync_tuning_t;
+
+/* Returns one of the predefined tuning profiles, or NULL if there is no
+ * profile with the given name:
+ *
+ *   "throughput": journal_mode=WAL, synchronous=NORMAL, cache_size=-65536
+ *                 (64 MiB), mmap_size=268435456 (256 MiB), temp_store=MEMORY.
+ *                 A committed transaction may be lost on power failure, but
+ *                 the database will not be corrupted.
+ *   "durable":    journal_mode=WAL, synchronous=FULL.
+ */
+const sqlasync_tuning_t *sqlasync_tuning_preset(const char *name);
+
+/* Set the PRAGMAs to run when the database is opened. They are run by the
+ * database thread before the result of sqlasync_open() is passed back, so
+ * that no other query can run on an untuned connection. If any of them fails,
+ * the open fails with the error of that PRAGMA. Note that page_size only has
+ * an effect on a new database, and that in-memory databases can't use WAL
+ * mode; SQLite silently ignores such settings.
+ *
+ * The settings are copied, `tuning' does not have to remain valid after this
+ * call. This function should be called before sqlasync_open(). Passing NULL
+ * removes any earlier settings. By default, the SQLite defaults are used. */
+sqlasync_t *sqlasync_tune(sqlasync_t *sql, const sqlasync_tuning_t *tuning);
+
+/* Enable a cache of the results of queries with the SQLASYNC_CACHE flag, using
+ * at most about `maxmem' bytes of memory. Results are cached by the query
+ * string and its bind values. A cached query is served directly from
+ * sqlasync_sql(), in the calling thread, without involving the database
+ * thread, unless an earlier query on the same result queue is still pending.
+ * In that case the query is queued and executed as usual, so that results
+ * stay in order and a query sees the changes of earlier queries on its queue.
+ * A cache hit does not wait for queries on other queues, and will not reflect
+ * their changes if they haven't been processed yet.
+ *
+ * Only successful read-only queries are cached. A cache entry is removed when
+ * any of the tables read by its query is modified through this sqlasync_t
+ * object, when any transaction or savepoint is rolled back, and by any
+ * schema change or sqlasync_custom() operation. Modifications made by other
+ * connections are not detected, so don't use this cache on tables that are
+ * written to by other processes, and don't use it on queries with
+ * non-deterministic functions such as random(). Entries are evicted in least
+ * recently used order when the cache is full. Hit rates and other statistics
+ * are available through sqlasync_stats().
+ *
+ * This function should be called before sqlasync_open(). A `maxmem' of 0
+ * disables the cache (default). */
+sqlasync_t *sqlasync_cache(sqlasync_t *sql, size_t maxmem);
+
+/* Move WAL checkpoints out of the query path. SQLite normally runs a
+ * checkpoint as part of whichever COMMIT happens to cross the
+ * wal_autocheckpoint threshold, which can add considerable latency to that
+ * transaction. With this function, the automatic checkpoint is disabled and
+ * sqlasync instead runs a PASSIVE checkpoint on a separate connection and
+ * thread whenever the database thread becomes idle after having written
+ * something. If the WAL is larger than `maxwal' pages after that checkpoint,
+ * another checkpoint is run with the given `mode', which should be
+ * SQLITE_CHECKPOINT_FULL, SQLITE_CHECKPOINT_RESTART or
+ * SQLITE_CHECKPOINT_TRUNCATE. Such a checkpoint may block writers for a short
+ * time. A `maxwal' of 0 disables escalation.
+ *
+ * The database should be put in WAL mode by the application. Background
+ * checkpoints are not used for in-memory or temporary databases. The
+ * checkpoint connection is opened with the same name and flags as given to
+ * sqlasync_open(). If that fails, the automatic checkpoint is left enabled
+ * and the error is reported on the second queue given to sqlasync_open().
+ * Checkpoint statistics are available through sqlasync_stats().
+ *
+ * This function should be called before sqlasync_open(). */
+sqlasync_t *sqlasync_checkpoint(sqlasync_t *sql, unsigned int maxwal, int mode);
+
+/* Serve all queries from an in-memory database, with write-behind persistence
+ * to the file given to sqlasync_open(). The file is opened (with the open
+ * flags and tuning, if any) and its contents loaded into a new in-memory
+ * database, which is then used for all operations. After a transaction has
+ * been committed, the in-memory database is copied to the file, at most once
+ * every `interval' milliseconds. The copy is made in steps of a limited number
+ * of pages, run by the database thread between operations and while the
+ * connection is in autocommit mode, so a query only has to wait for the step
+ * in progress. Transactions committed while a copy is in progress are included
+ * in that copy. A final copy is completed or made when the database is closed
+ * with sqlasync_close() or sqlasync_destroy().
+ *
+ * Committed transactions that have not been copied yet are lost if the
+ * process dies. The file is written through the backup API, so each copy is
+ * a single transaction on the file, and the file is never left half
+ * written. The file stays locked from the first step of a copy to the last,
+ * other readers of the file should set a busy timeout. If the file is locked
+ * by another connection, the copy is continued after another interval. Any
+ * other failure to write the file is reported on the second queue given to
+ * sqlasync_open(); a failed copy is started over after another interval, but
+ * a failed final copy loses the changes since the last successful one. Other
+ * processes must not write to the file. Checkpointing (see
+ * sqlasync_checkpoint()) does not apply to a persisted database. This
+ * function requires SQLite 3.36.0 or later.
+ *
+ * This function should be called before sqlasync_open(). */
+sqlasync_t *sqlasync_persist(sqlasync_t *sql, unsigned int interval);
+
+/* Get a snapshot of the statistics of the database thread. */
+void sqlasync_stats(sqlasync_t *sql, sqlasync_stats_t *stats);
+
+/* Enable per-query instrumentation. Once enabled, the time of submission,
+ * start and end of execution, the number of rows returned and the SQLite
+ * statement counters are recorded for each SQL query, and aggregated into
+ * sqlasync_stats() and sqlasync_querystats(). This has a small overhead,
+ * which is why it is disabled by default.
+ *
+ * If `func' is not NULL, it is called from the database thread after each
+ * query has finished. It must not call any sqlasync_*() functions other than
+ * those for queuing results. The `query' string is only valid for the
+ * duration of the callback.
+ *
+ * This function should be called before sqlasync_open(). */
+void sqlasync_instrument(sqlasync_t *sql, sqlasync_instrument_func_t func, void *data);
+
+/* Log slow queries to the given queue. Implies sqlasync_instrument(). Any
+ * SQL query that took `threshold' or more microseconds to execute (not
+ * counting the time it spent waiting in the queue) is passed to the queue as
+ * a result without the `last' flag set, with `result' set to the result code
+ * of the query, and the following columns:
+ *   0. Query (SQLITE_TEXT)
+ *   1. Queue time, in microseconds (SQLITE_INTEGER)
+ *   2. Execution time, in microseconds (SQLITE_INTEGER)
+ *   3. Number of rows returned (SQLITE_INTEGER)
+ *   4. SQLITE_STMTSTATUS_FULLSCAN_STEP (SQLITE_INTEGER)
+ *   5. SQLITE_STMTSTATUS_SORT (SQLITE_INTEGER)
+ *   6. SQLITE_STMTSTATUS_VM_STEP (SQLITE_INTEGER)
+ *   7. Output of EXPLAIN QUERY PLAN, one line per step (SQLITE_TEXT or
+ *      SQLITE_NULL if the query could not be explained)
+ * An SQLITE_OK result with the `last' flag set is passed when the sqlasync_t
+ * object is destroyed. As with the second queue of sqlasync_open(), you should
+ * not use an async queue with `each' set to 0.
+ *
+ * This function should be called before sqlasync_open(). */
+sqlasync_queue_t *sqlasync_slowlog(sqlasync_t *sql, sqlasync_queue_t *q, unsigned int threshold);
+
+/* Get the per-query aggregated statistics collected since instrumentation
+ * has been enabled. One SQLITE_ROW result is passed back for each distinct
+ * query string, followed by an SQLITE_DONE. The columns are: Query, number of
+ * executions, total queue time, total execution time, total rows returned,
+ * total fullscan steps, total sorts and total VM steps. At most 1024 distinct
+ * query strings are tracked, so it helps to use bind values rather than
+ * literals in queries. */
+sqlasync_queue_t *sqlasync_querystats(sqlasync_t *sql, sqlasync_queue_t *q);
+
 /* Opens an SQLite database. It is an error to call this function on an
  * sqlasync_t object which already has an SQLite database opened. (You can
  * always use a "ATTACH DATABASE" query if you want to handle multiple
@@ -378,6 +749,8 @@ typedef enum {
 	 * consistent view of the query chain.
 	 * If any query inside a NEXT chain fails, the transaction is aborted and
 	 * all subsequent queries in the chain will get an SQLITE_ERROR result.
+	 * (If the sqlasync_t object has been created with a transtimeout, only
+	 * the modifications of the chain itself are rolled back.)
 	 * If the sqlasync_t object has been created with transtimeout = NULL, then
 	 * the last query in the chain will behave as if it is given the
 	 * SQLASYNC_LAST flag. Otherwise, subsequent queries may be grouped in the
@@ -389,7 +762,37 @@ typedef enum {
 	/* The query must be executed outside of a transaction. This flag has no
 	 * effect if the sqlasync_t object has been created with a NULL
 	 * transtimeout, since with that it's the default. */
-	SQLASYNC_SINGLE = (3<<2)
+	SQLASYNC_SINGLE = (3<<2),
+	/* The `last' result of the query is only passed back after the
+	 * transaction it has been executed in has been committed. Unlike
+	 * SQLASYNC_LAST, this does not cause the transaction to be committed
+	 * early, so queries can still be grouped into a single transaction. If
+	 * the transaction fails to commit or is rolled back because of an error
+	 * in another query, the `last' result will be an error instead: The
+	 * error code of the COMMIT, or SQLITE_ABORT if it has been rolled back.
+	 * Results of later operations on the same queue are held back as well,
+	 * so that they still arrive in order. Results queued by a
+	 * sqlasync_custom() function are not held.
+	 * Can be combined with the above flags. */
+	SQLASYNC_DURABLE = (1<<4),
+	/* Queue the query in the high priority lane. The database thread always
+	 * processes queries in the high priority lane before those in the normal
+	 * lane, except that it will never interrupt a NEXT chain. Queries within
+	 * the same lane are processed in FIFO order. When queuing multiple queries
+	 * within a sqlasync_lock(), all of them end up in the lane of the first
+	 * query. Note that a priority query may be processed before a query that
+	 * has been queued earlier in the normal lane, so don't use this flag if
+	 * the query depends on the modifications of such an earlier query.
+	 * Can be combined with the above flags. */
+	SQLASYNC_PRIO = (1<<5),
+	/* Use the result cache for this query, see sqlasync_cache(). This flag
+	 * is ignored when combined with SQLASYNC_NEXT or SQLASYNC_LAST, and by
+	 * sqlasync_sql_many(), sqlasync_sql_layout() and sqlasync_sql_visit().
+	 * The cache is only consulted by sqlasync_sql() and
+	 * sqlasync_sql_deadline(), queries queued with the _unlocked() functions
+	 * are always executed.
+	 * Can be combined with the above flags. */
+	SQLASYNC_CACHE = (1<<6)
 } sqlasync_flags_t;
 
 
@@ -422,11 +825,249 @@ typedef enum {
 sqlasync_queue_t *sqlasync_sql(sqlasync_t *sql, sqlasync_queue_t *q,
 		int flags, const char *query, int bind_num, ...);
 
+/* Same as sqlasync_sql(), but with a deadline for this query alone. The
+ * deadline is an absolute CLOCK_MONOTONIC time, and takes the place of the
+ * timeout set with sqlasync_queue_timeout(). A query that hasn't finished by
+ * then is handled as described for sqlasync_queue_timeout(). A NULL deadline
+ * falls back to the timeout of the queue. */
+sqlasync_queue_t *sqlasync_sql_deadline(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const struct timespec *deadline, const char *query, int bind_num, ...);
+
+
+/* Execute the same query multiple times with different bind values. This is
+ * considerably more efficient than calling sqlasync_sql() for each set of
+ * values: The query is only prepared once and all rows are executed within a
+ * single transaction.
+ *
+ * `values' is an array of `nrows' * `ncols' bind values, where the values for
+ * the first execution come first, followed by the values for the second, etc.
+ * The array itself is copied, the memory of the individual values is managed
+ * in the same way as with sqlasync_sql().
+ *
+ * If the sqlasync_t object has been created without a transtimeout or if
+ * SQLASYNC_SINGLE is given, the rows are executed in a transaction of their
+ * own, and the `last' result is only passed back after this transaction has
+ * been committed. Otherwise the rows are executed in the currently active
+ * transaction, as with a normal query.
+ *
+ * Any rows returned by the query are passed back as with sqlasync_sql(). If
+ * an execution fails without aborting the transaction (e.g. a constraint
+ * violation), the failure is passed back as a result without the `last' flag
+ * set, `result' indicating the error code, and two columns: The index of the
+ * failed row (SQLITE_INTEGER, starting at 0) and the error message. Processing
+ * then continues with the next row. The `last' result is SQLITE_DONE if all
+ * rows have been processed, or an error if the entire operation failed, in
+ * which case none of the modifications have been committed.
+ */
+sqlasync_queue_t *sqlasync_sql_many(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const char *query, int ncols, int nrows, const sqlasync_value_t *values);
+
+
+/* Row layouts, for decoding query results directly into C structs. A layout
+ * describes a struct of `size' bytes, and for each field the column it is
+ * read from, its C type and its offset within the struct. For example:
+ *
+ *   struct user { sqlite3_int64 id; const char *name; double score; };
+ *   static const sqlasync_field_t user_fields[] = {
+ *     SQLASYNC_FIELD(0, SQLASYNC_FIELD_INT64,  struct user, id),
+ *     SQLASYNC_FIELD(1, SQLASYNC_FIELD_TEXT,   struct user, name),
+ *     SQLASYNC_FIELD(2, SQLASYNC_FIELD_DOUBLE, struct user, score)
+ *   };
+ *   static const sqlasync_layout_t user_layout = {
+ *     sizeof(struct user), 3, user_fields
+ *   };
+ *
+ * Columns are converted as with sqlite3_column_int64(), _int(), _double() and
+ * _text(). A NULL value results in 0, or a NULL pointer for text fields.
+ */
+typedef enum {
+	SQLASYNC_FIELD_INT64,  /* sqlite3_int64 */
+	SQLASYNC_FIELD_INT,    /* int */
+	SQLASYNC_FIELD_DOUBLE, /* double */
+	SQLASYNC_FIELD_TEXT    /* const char *, zero-terminated */
+} sqlasync_field_type_t;
+
+typedef struct {
+	int col;
+	sqlasync_field_type_t type;
+	size_t offset;
+} sqlasync_field_t;
+
+#define SQLASYNC_FIELD(_col, _type, _struct, _member) { _col, _type, offsetof(_struct, _member) }
+
+typedef struct {
+	size_t size;
+	unsigned int numfields;
+	const sqlasync_field_t *fields;
+} sqlasync_layout_t;
+
+/* Perform an SQL query as with sqlasync_sql(), but pass back the rows in
+ * batches of at most `batch' rows, decoded according to the given layout. The
+ * layout must remain valid until the `last' result has been received.
+ *
+ * Each batch is passed back as a result with `result' == SQLITE_ROW and two
+ * columns: A BLOB holding an array of structs, followed by the strings the
+ * text fields point to, and the number of structs in the array as an
+ * SQLITE_INTEGER. All data of a batch is thus in a single buffer, which is
+ * freed together with the result. For example:
+ *
+ *   struct user *users = r->col[0].val.ptr;
+ *   int i;
+ *   for(i=0; i<r->col[1].val.i64; i++)
+ *     printf("%s\n", users[i].name);
+ *
+ * The end of the result set and errors are passed back as with sqlasync_sql().
+ */
+sqlasync_queue_t *sqlasync_sql_layout(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const sqlasync_layout_t *layout, unsigned int batch, const char *query, int bind_num, ...);
+
+
+typedef int(*sqlasync_visit_func_t)(sqlasync_queue_t *q, sqlite3_stmt *st, void *data);
+
+/* Perform an SQL query as with sqlasync_sql(), but rather than passing back
+ * the rows, call `func' from the database thread for each row. The callback
+ * can read the current row with the sqlite3_column_*() functions on `st'.
+ * The values are not copied, and are only valid until the callback returns.
+ * Returning non-zero stops the query early, it then finishes as if there were
+ * no more rows.
+ *
+ * When all rows have been visited, `func' is called once more with `st' set
+ * to NULL. It can then pass an aggregate of the rows to the application with
+ * sqlasync_queue_result(q, ..), which is received before the `last' result of
+ * the query. This call is skipped if the query fails. The callback must not
+ * call any other sqlasync_*() functions, and should be quick: no other
+ * queries are processed while it runs.
+ *
+ * `data' is passed as-is to the callback. Once the `last' result has been
+ * received, the callback won't be called anymore, so `data' may also be
+ * used to collect the aggregate. */
+sqlasync_queue_t *sqlasync_sql_visit(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, sqlasync_visit_func_t func, void *data, const char *query, int bind_num, ...);
+
+
+/* Intern an SQL query string. The returned string remains valid until the
+ * sqlasync_t object is destroyed, and can be passed as query to any of the
+ * functions accepting one when the SQLASYNC_INTERNED flag is used, e.g.:
+ *
+ *   const char *ins = sqlasync_intern(s, "INSERT INTO t VALUES (?)");
+ *   sqlasync_sql(s, q, SQLASYNC_INTERNED, ins, 1, sqlasync_int(1));
+ *
+ * An interned query is never copied, and its prepared statement is cached by
+ * the database thread, so the query only needs to be parsed once for as long
+ * as the database remains open. Interning the same string twice returns the
+ * same pointer. This function is intended to be used for a limited number of
+ * frequently used queries, the interned strings are never freed before
+ * sqlasync_destroy(), and interning itself is not particularly fast. */
+const char *sqlasync_intern(sqlasync_t *sql, const char *query);
+
+
+/* Cursors fetch the results of a query in pages. Between pages, the prepared
+ * statement is kept aside and the database thread is free to process other
+ * queries. This is an alternative to sqlasync_queue_buffersize() that doesn't
+ * stall the database thread when the application can't keep up with large
+ * result sets.
+ *
+ * sqlasync_cursor_open() queues the preparation of the query. `flags' can be
+ * from sqlasync_bufmanage_t and SQLASYNC_PRIO, the other sqlasync_flags_t
+ * flags are ignored. The queue receives a SQLITE_OK result when the query has
+ * been prepared, or an error result. In both cases the `last' flag is set.
+ * Queries from sqlasync_intern() are prepared separately for a cursor, the
+ * cached statement is not used.
+ *
+ * sqlasync_cursor_next() queues the fetching of at most `n' rows. These are
+ * passed back to the queue of the cursor as with sqlasync_sql(), followed by
+ * one result with the `last' flag set: SQLITE_OK if more rows may be
+ * available, SQLITE_DONE if the result set has been exhausted, or an error.
+ * After SQLITE_DONE or an error, any further calls return SQLITE_DONE. If the
+ * cursor could not be opened, any calls return SQLITE_MISUSE instead. Cursors
+ * are subject to sqlasync_cancel() and sqlasync_queue_timeout(), with the
+ * deadline starting at each call.
+ *
+ * sqlasync_cursor_close() frees the cursor. This does not cause any results to
+ * be passed back, but any previously queued cursor operations will still be
+ * processed. The cursor must not be used afterwards. Cursors that haven't
+ * been closed are freed by sqlasync_destroy().
+ *
+ * Note that an open cursor keeps a read transaction open until its result set
+ * has been exhausted, which prevents other processes from writing to the
+ * database unless it is in WAL mode. Since the cursor shares the connection
+ * with other queries, later pages may include changes made by queries
+ * processed in between, even if these have not been committed yet. When the
+ * database is closed, any cursors that haven't been exhausted will return
+ * SQLITE_MISUSE.
+ */
+typedef struct sqlasync_cursor_t sqlasync_cursor_t;
+
+sqlasync_cursor_t *sqlasync_cursor_open(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const char *query, int bind_num, ...);
+void sqlasync_cursor_next(sqlasync_t *sql, sqlasync_cursor_t *cur, unsigned int n);
+void sqlasync_cursor_close(sqlasync_t *sql, sqlasync_cursor_t *cur);
+
+
+/* Copy the database to the file `dest' while it remains in use. The backup is
+ * done incrementally, copying `pages' pages at a time (or everything in one
+ * go if `pages' <= 0), with a pause of at least `pause' milliseconds between
+ * steps. Steps are only taken when the database thread is not executing
+ * other operations and is not in a transaction, so queries keep running at
+ * nearly full speed in the meantime. If the database is modified through
+ * this sqlasync_t object during the backup, the changes are included in the
+ * copy. Modifications by other connections cause the backup to restart.
+ *
+ * After each step, a result with SQLITE_OK and two SQLITE_INTEGER columns is
+ * passed to the queue: the number of pages still to be copied and the total
+ * number of pages. When the backup has completed, an SQLITE_DONE result with
+ * the `last' flag set is passed, with as columns the number of pages copied
+ * and the elapsed time in microseconds. On error, the result has the error
+ * code and message as usual.
+ *
+ * Only one backup can be in progress at a time. A backup still in progress
+ * when the database is closed is completed first; if that fails (e.g. because
+ * the destination is locked), its last result has the error instead. The
+ * `dest' string is copied internally. */
+sqlasync_queue_t *sqlasync_backup(sqlasync_t *sql, sqlasync_queue_t *q, const char *dest, int pages, unsigned int pause);
+
+
+/* Subscribe to the modifications made through this sqlasync_t object. After
+ * each committed transaction that has modified any of the given tables
+ * (NULL-terminated, case-insensitive; NULL to get all tables), a result with
+ * SQLITE_ROW is passed to the queue. It has three columns for every modified
+ * row, in the order of modification:
+ *   0. Table name (SQLITE_TEXT)
+ *   1. SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE (SQLITE_INTEGER)
+ *   2. rowid (SQLITE_INTEGER)
+ * The changes are reported once the transaction has been committed. Changes
+ * that are rolled back, whether by a ROLLBACK, a failed query, or a ROLLBACK
+ * TO a savepoint, are never reported.
+ *
+ * This is built on sqlite3_update_hook(), with its limitations: WITHOUT ROWID
+ * tables are not reported, and neither are rows removed by a DELETE without a
+ * WHERE clause when the truncate optimization applies, or rows replaced by
+ * the REPLACE conflict resolution. Changes made by other connections or
+ * processes are not seen. Changes made by a sqlasync_custom() function are
+ * reported as normal, except that the changes of a statement that fails
+ * within such a function may be reported even if SQLite has undone them. A
+ * statement that fails with the FAIL conflict resolution keeps its earlier
+ * changes, these are not reported.
+ *
+ * The subscription lasts until sqlasync_unsubscribe() or until the database is
+ * closed, and ends with an SQLITE_OK result with `last' set. The database
+ * should be opened before subscribing, an SQLITE_MISUSE error is returned
+ * otherwise. As with the second queue of sqlasync_open(), you should not use
+ * an async queue with `each' set to 0. The table names are copied
+ * internally. */
+sqlasync_queue_t *sqlasync_subscribe(sqlasync_t *sql, sqlasync_queue_t *q, const char *const *tables);
+
+/* End the subscription of the given queue. */
+void sqlasync_unsubscribe(sqlasync_t *sql, sqlasync_queue_t *q);
+
 
 /* The functions below are for locked access to the SQL queue. This is useful
- * if you want a set of queries to be executed as a sequence. While locked,
- * other threads will not be able to queue SQL queries, and the database thread
- * will not be able to process new queries.
+ * if you want a set of queries to be executed as a sequence. Queries queued
+ * with the _unlocked() functions are collected while the lock is held, and are
+ * passed to the database thread as a single unit in sqlasync_unlock(). No
+ * queries from other threads can end up in between them. Only one thread can
+ * hold the lock at a time, but holding it blocks neither the database thread
+ * nor other threads submitting queries with sqlasync_sql().
  *
  * Query chains with the SQLASYNC_NEXT flags _must_ be queued from a single
  * critical section. For example:
@@ -448,6 +1089,58 @@ sqlasync_queue_t *sqlasync_sql_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
 sqlasync_queue_t *sqlasync_sqlv_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
 		int flags, const char *query, int bind_num, va_list binds);
 
+sqlasync_queue_t *sqlasync_sql_deadline_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const struct timespec *deadline, const char *query, int bind_num, ...);
+
+sqlasync_queue_t *sqlasync_sql_many_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const char *query, int ncols, int nrows, const sqlasync_value_t *values);
+
+sqlasync_queue_t *sqlasync_sql_layout_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, const sqlasync_layout_t *layout, unsigned int batch, const char *query, int bind_num, ...);
+sqlasync_queue_t *sqlasync_sql_visit_unlocked(sqlasync_t *sql, sqlasync_queue_t *q,
+		int flags, sqlasync_visit_func_t func, void *data, const char *query, int bind_num, ...);
+
+
+
+
+/* A router distributes queries over a number of sqlasync_t objects, called
+ * shards, each with its own database thread and database file. This allows
+ * write throughput to scale beyond what a single database thread can handle.
+ *
+ * sqlasync_router_create() creates `num' (at least one) shards with the given
+ * transtimeout. The individual shards can be obtained with
+ * sqlasync_router_shard(), and should be configured and opened as usual, e.g.:
+ *
+ *   for(i=0; i<num; i++) {
+ *     snprintf(fn, sizeof(fn), "shard%u.db", i);
+ *     sqlasync_open(sqlasync_router_shard(r, i), q, errq, fn, 0);
+ *   }
+ *
+ * sqlasync_router_route() returns the shard for a key, given a hash of that
+ * key supplied by the application. The returned object can be used with any
+ * of the normal query functions. Note that queries from sqlasync_intern() are
+ * specific to a single shard.
+ *
+ * sqlasync_router_all() queues a query on all shards, as with sqlasync_sql().
+ * The rows returned by each shard are passed to the given queue as they
+ * arrive, so rows from different shards may be interleaved. Only a single
+ * result with the `last' flag set is passed back after all shards have
+ * finished: SQLITE_DONE if the query succeeded on all shards, or the error of
+ * the first shard that failed. There is no transaction spanning multiple
+ * shards. The SQLASYNC_INTERNED flag can't be used with this function.
+ * Cancelling the queue with sqlasync_cancel() cancels the query on all shards.
+ *
+ * sqlasync_router_destroy() calls sqlasync_destroy() on all shards.
+ */
+typedef struct sqlasync_router_t sqlasync_router_t;
+
+sqlasync_router_t *sqlasync_router_create(unsigned int num, const struct timespec *transtimeout);
+sqlasync_t *sqlasync_router_shard(sqlasync_router_t *router, unsigned int i);
+sqlasync_t *sqlasync_router_route(sqlasync_router_t *router, unsigned int hash);
+sqlasync_queue_t *sqlasync_router_all(sqlasync_router_t *router, sqlasync_queue_t *q,
+		int flags, const char *query, int bind_num, ...);
+void sqlasync_router_destroy(sqlasync_router_t *router);
+
 
 
 
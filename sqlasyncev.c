@@ -0,0 +1,114 @@
+/* Copyright (c) 2013 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if defined(EV_CONFIG_H)
+#include EV_CONFIG_H
+#elif defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include "sqlasyncev.h"
+#include <stdlib.h>
+
+
+typedef struct {
+	ev_async async;
+	sqlasync_wakeup_t *w;
+	/* Whether we hold a reference on the loop. Only accessed from the thread
+	 * running the loop. */
+	int ref;
+#if EV_MULTIPLICITY
+	struct ev_loop *loop;
+#endif
+} sqlasync_ev_t;
+
+
+static void sqlasync_ev_async(EV_P_ ev_async *async, int revents) {
+	sqlasync_ev_t *e = async->data;
+	/* sqlasync_dispatch() calls the schedule callback again if there are still
+	 * queries scheduled, and there will be another wakeup when the last one
+	 * finishes, so we can always drop our reference here. */
+	if(e->ref) {
+		ev_unref(EV_A);
+		e->ref = 0;
+	}
+	sqlasync_dispatch(e->w);
+}
+
+
+/* Called from the database thread or from sqlasync_dispatch() */
+static void sqlasync_ev_wakeup_cb(sqlasync_wakeup_t *w, void *data) {
+	sqlasync_ev_t *e = data;
+#if EV_MULTIPLICITY
+	struct ev_loop *loop = e->loop;
+#endif
+	ev_async_send(EV_A_ &e->async);
+}
+
+
+static void sqlasync_ev_schedule_cb(sqlasync_wakeup_t *w, void *data) {
+	sqlasync_ev_t *e = data;
+#if EV_MULTIPLICITY
+	struct ev_loop *loop = e->loop;
+#endif
+	if(!e->ref) {
+		ev_ref(EV_A);
+		e->ref = 1;
+	}
+}
+
+
+sqlasync_wakeup_t *sqlasync_ev_wakeup(EV_P) {
+	sqlasync_ev_t *e = calloc(1, sizeof(sqlasync_ev_t));
+	if(!e)
+		return NULL;
+	e->w = sqlasync_wakeup_create(sqlasync_ev_wakeup_cb, sqlasync_ev_schedule_cb, e);
+	if(!e->w) {
+		free(e);
+		return NULL;
+	}
+
+	ev_async_init(&e->async, sqlasync_ev_async);
+	ev_async_start(EV_A_ &e->async);
+	ev_unref(EV_A);
+	e->async.data = e;
+#if EV_MULTIPLICITY
+	e->loop = loop;
+#endif
+	return e->w;
+}
+
+
+void sqlasync_ev_wakeup_destroy(sqlasync_wakeup_t *w) {
+	sqlasync_ev_t *e = sqlasync_wakeup_data(w);
+#if EV_MULTIPLICITY
+	struct ev_loop *loop = e->loop;
+#endif
+	if(e->ref)
+		ev_unref(EV_A);
+	ev_ref(EV_A);
+	ev_async_stop(EV_A_ &e->async);
+	sqlasync_wakeup_destroy(w);
+	free(e);
+}
+
+/* vim: set noet sw=4 ts=4: */
@@ -0,0 +1,57 @@
+/* Copyright (c) 2013 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* libev integration for sqlasync: a wakeup object that dispatches results
+ * from the event loop.
+ *
+ *   sqlasync_wakeup_t *w = sqlasync_ev_wakeup(EV_DEFAULT);
+ *   sqlasync_sql(sql, sqlasync_queue_async(w, 0, result_cb, NULL), ...);
+ *   ev_run(EV_DEFAULT_ 0);
+ *
+ * A single ev_async watcher is used per wakeup object, and the database thread
+ * only signals it when sqlasync_dispatch() has work to do: sqlasync itself
+ * suppresses further wakeups until the pending dispatch has run. The watcher
+ * does not keep the loop alive by itself, but the wakeup object holds a
+ * reference on the loop as long as there are queries scheduled on it. That is,
+ * ev_run() will not return while there are still results to be received.
+ *
+ * As with any wakeup object, queries should be scheduled from the thread that
+ * runs the event loop.
+ */
+
+#ifndef SQLASYNCEV_H
+#define SQLASYNCEV_H
+
+#include "sqlasync.h"
+#include <ev.h>
+
+/* Create a wakeup object bound to the given event loop. Returns NULL if
+ * malloc() fails. */
+sqlasync_wakeup_t *sqlasync_ev_wakeup(EV_P);
+
+/* Free a wakeup object created with sqlasync_ev_wakeup(). The same
+ * restrictions as with sqlasync_wakeup_destroy() apply. */
+void sqlasync_ev_wakeup_destroy(sqlasync_wakeup_t *wakeup);
+
+#endif
+
+/* vim: set noet sw=4 ts=4: */
@@ -0,0 +1,279 @@
+/* Copyright (c) 2013 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+/* Benchmarks for sqlasync. Usage:
+ *
+ *   ./sqlasync-bench [dir]
+ *
+ * The database is created in `dir' (default /tmp), so run it once on a tmpfs
+ * and once on a real disk to see the difference that fsync() makes. Results
+ * are written to stdout as CSV, with the columns:
+ *
+ *   benchmark,parameter,dir,value,unit
+ */
+
+#include "sqlasync.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define POINT_ROWS   10000
+#define POINT_QUERIES 5000
+#define SCAN_ROWS    200000
+#define ASYNC_QUERIES 20000
+
+static const char *dir;
+static char fn[256];
+
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+
+static void report(const char *bench, const char *param, double value, const char *unit) {
+	printf("%s,%s,%s,%.2f,%s\n", bench, param, dir, value, unit);
+	fflush(stdout);
+}
+
+
+static void check(sqlasync_result_t *r, int result) {
+	if(r->result != result) {
+		fprintf(stderr, "Unexpected result %d: %s\n", r->result,
+			r->numcol && r->col[0].type == SQLITE_TEXT ? (char *)r->col[0].val.ptr : "");
+		exit(1);
+	}
+	sqlasync_result_free(r);
+}
+
+
+/* Opens a fresh database file with the given transtimeout (in ms, 0 for none) */
+static sqlasync_t *db_open(sqlasync_queue_t *q, unsigned int timeout) {
+	struct timespec ts = { timeout/1000, (timeout%1000)*1000000 };
+	char aux[300];
+	unlink(fn);
+	snprintf(aux, sizeof(aux), "%s-wal", fn);
+	unlink(aux);
+	snprintf(aux, sizeof(aux), "%s-shm", fn);
+	unlink(aux);
+
+	sqlasync_t *sql = sqlasync_create(timeout ? &ts : NULL);
+	sqlasync_open(sql, q, NULL, fn, 0);
+	check(sqlasync_queue_get(q), SQLITE_OK);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "PRAGMA journal_mode=WAL", 0);
+	check(sqlasync_queue_get(q), SQLITE_ROW);
+	check(sqlasync_queue_get(q), SQLITE_DONE);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE t (id INTEGER PRIMARY KEY, v TEXT)", 0);
+	check(sqlasync_queue_get(q), SQLITE_DONE);
+	return sql;
+}
+
+
+static void db_fill(sqlasync_t *sql, sqlasync_queue_t *q, int rows) {
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < ?)"
+		" INSERT INTO t SELECT x, hex(randomblob(16)) FROM c", 1, sqlasync_int(rows));
+	check(sqlasync_queue_get(q), SQLITE_DONE);
+}
+
+
+/* Insert rate with different transaction timeouts. Inserts are queued all at
+ * once, so with a timeout they are grouped into few transactions. */
+static void bench_insert() {
+	static const unsigned int timeouts[] = { 0, 1, 10, 100 };
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	unsigned int i;
+	int j;
+	char param[32];
+
+	for(i=0; i<sizeof(timeouts)/sizeof(*timeouts); i++) {
+		int n = timeouts[i] ? 50000 : 1000;
+		sqlasync_t *sql = db_open(q, timeouts[i]);
+		double start = now();
+		for(j=0; j<n; j++)
+			sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO t (v) VALUES (?)", 1, sqlasync_text(SQLASYNC_STATIC, "some value"));
+		for(j=0; j<n; j++)
+			check(sqlasync_queue_get(q), SQLITE_DONE);
+		/* Make sure the last transaction is included in the time */
+		sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE, "SELECT 1", 0);
+		check(sqlasync_queue_get(q), SQLITE_ROW);
+		check(sqlasync_queue_get(q), SQLITE_DONE);
+		snprintf(param, sizeof(param), "transtimeout=%ums", timeouts[i]);
+		report("insert", param, n/(now()-start), "rows/s");
+		sqlasync_destroy(sql);
+	}
+	sqlasync_queue_destroy(q);
+}
+
+
+static int cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* Round-trip latency of a point query on the primary key */
+static void bench_point() {
+	static double lat[POINT_QUERIES];
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_t *sql = db_open(q, 0);
+	int i;
+	db_fill(sql, q, POINT_ROWS);
+
+	for(i=0; i<POINT_QUERIES; i++) {
+		double start = now();
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT v FROM t WHERE id = ?", 1, sqlasync_int(1 + rand() % POINT_ROWS));
+		check(sqlasync_queue_get(q), SQLITE_ROW);
+		check(sqlasync_queue_get(q), SQLITE_DONE);
+		lat[i] = (now() - start) * 1e6;
+	}
+	qsort(lat, POINT_QUERIES, sizeof(*lat), cmpdouble);
+	report("point", "p50", lat[POINT_QUERIES/2], "us");
+	report("point", "p90", lat[POINT_QUERIES*9/10], "us");
+	report("point", "p99", lat[POINT_QUERIES*99/100], "us");
+	report("point", "max", lat[POINT_QUERIES-1], "us");
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+/* Full table scan, with different result queue sizes */
+static void bench_scan() {
+	static const unsigned int sizes[] = { 0, 1, 16, 256 };
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_t *sql = db_open(q, 0);
+	unsigned int i;
+	char param[32];
+	db_fill(sql, q, SCAN_ROWS);
+
+	for(i=0; i<sizeof(sizes)/sizeof(*sizes); i++) {
+		sqlasync_queue_t *sq = sqlasync_queue_buffersize(sqlasync_queue_sync(), sizes[i]);
+		double start = now();
+		sqlasync_sql(sql, sq, SQLASYNC_STATIC, "SELECT id, v FROM t", 0);
+		int rows = 0;
+		sqlasync_result_t *r;
+		while(!(r = sqlasync_queue_get(sq))->last) {
+			rows++;
+			sqlasync_result_free(r);
+		}
+		check(r, SQLITE_DONE);
+		snprintf(param, sizeof(param), "buffersize=%u", sizes[i]);
+		report("scan", param, rows/(now()-start), "rows/s");
+		sqlasync_queue_destroy(sq);
+	}
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+/* Pipelined point queries received on a sync queue, and on async queues
+ * dispatched from this thread. */
+static pthread_mutex_t asynclock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asynccond = PTHREAD_COND_INITIALIZER;
+static int asyncwoken, asyncdone;
+
+static void async_wakeup(sqlasync_wakeup_t *w, void *data) {
+	pthread_mutex_lock(&asynclock);
+	asyncwoken = 1;
+	pthread_cond_signal(&asynccond);
+	pthread_mutex_unlock(&asynclock);
+}
+
+
+static void async_result(sqlasync_queue_t *q, void *data) {
+	sqlasync_result_t *r;
+	while((r = sqlasync_queue_get(q))) {
+		int last = r->last;
+		sqlasync_result_free(r);
+		if(last)
+			asyncdone++;
+	}
+}
+
+
+static void bench_queues() {
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_t *sql = db_open(q, 0);
+	int i;
+	db_fill(sql, q, POINT_ROWS);
+
+	double start = now();
+	for(i=0; i<ASYNC_QUERIES; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT v FROM t WHERE id = ?", 1, sqlasync_int(1 + i % POINT_ROWS));
+	for(i=0; i<ASYNC_QUERIES; i++) {
+		check(sqlasync_queue_get(q), SQLITE_ROW);
+		check(sqlasync_queue_get(q), SQLITE_DONE);
+	}
+	report("queue", "sync", ASYNC_QUERIES/(now()-start), "queries/s");
+
+	sqlasync_wakeup_t *w = sqlasync_wakeup_create(async_wakeup, NULL, NULL);
+	sqlasync_queue_t *aq = sqlasync_queue_async(w, 0, async_result, NULL);
+	asyncdone = 0;
+	start = now();
+	for(i=0; i<ASYNC_QUERIES; i++)
+		sqlasync_sql(sql, aq, SQLASYNC_STATIC, "SELECT v FROM t WHERE id = ?", 1, sqlasync_int(1 + i % POINT_ROWS));
+	while(asyncdone < ASYNC_QUERIES) {
+		pthread_mutex_lock(&asynclock);
+		while(!asyncwoken)
+			pthread_cond_wait(&asynccond, &asynclock);
+		asyncwoken = 0;
+		pthread_mutex_unlock(&asynclock);
+		sqlasync_dispatch(w);
+	}
+	report("queue", "async", ASYNC_QUERIES/(now()-start), "queries/s");
+
+	sqlasync_queue_destroy(aq);
+	sqlasync_destroy(sql);
+	/* Destroying the queue may have triggered a final wakeup */
+	sqlasync_dispatch(w);
+	sqlasync_wakeup_destroy(w);
+	sqlasync_queue_destroy(q);
+}
+
+
+int main(int argc, char **argv) {
+	dir = argc > 1 ? argv[1] : "/tmp";
+	snprintf(fn, sizeof(fn), "%s/sqlasync-bench-%d.db", dir, (int)getpid());
+
+	printf("benchmark,parameter,dir,value,unit\n");
+	bench_insert();
+	bench_point();
+	bench_scan();
+	bench_queues();
+
+	char aux[300];
+	unlink(fn);
+	snprintf(aux, sizeof(aux), "%s-wal", fn);
+	unlink(aux);
+	snprintf(aux, sizeof(aux), "%s-shm", fn);
+	unlink(aux);
+	return 0;
+}
+
+/* vim: set noet sw=4 ts=4: */
@@ -20,11 +20,6 @@
   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
-/* TODO:
- * - Test transaction grouping (how?)
- * - Test SQLITE_BUSY handling
- */
-
 #ifdef NDEBUG
 #error These tests should not be compiled with -DNDEBUG!
 #endif
@@ -37,6 +32,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdarg.h>
 
 
 /* These checks are implemented as macros to make error reporting with assert()
@@ -48,6 +47,12 @@
 		sqlasync_result_free(_r);\
 	} while(0)
 
+#define check_ok_res(_q) do {\
+		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
+		assert(_r->result == SQLITE_OK && _r->numcol == 0 && _r->last);\
+		sqlasync_result_free(_r);\
+	} while(0)
+
 #define check_err_res(_q) do {\
 		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
 		assert(_r->result != SQLITE_DONE && _r->result != SQLITE_OK && _r->numcol == 1 && _r->last);\
@@ -181,6 +186,40 @@ static void test_sql() {
 	check_err_res(qr); /* 8 */
 	check_done_res(qr); /* 9 */
 
+	/* Bulk insert, with one failing row */
+	sqlasync_value_t rows[] = { sqlasync_int(1), sqlasync_text(0, "t"), sqlasync_int(2), sqlasync_text(0, "s"), sqlasync_int(3) };
+	sqlasync_sql_many(sql, qr, SQLASYNC_STATIC, "INSERT INTO sqlasync_a VALUES (?)", 1, 5, rows);
+	r = sqlasync_queue_get(qr);
+	assert(r->result == SQLITE_CONSTRAINT && r->numcol == 2 && !r->last);
+	assert(r->col[0].type == SQLITE_INTEGER && r->col[0].val.i64 == 3);
+	assert(r->col[1].type == SQLITE_TEXT && r->col[1].val.ptr);
+	sqlasync_result_free(r);
+	check_done_res(qr);
+	sqlasync_sql(sql, qr, SQLASYNC_STATIC, "SELECT COUNT(*) FROM sqlasync_a", 0);
+	r = sqlasync_queue_get(qr);
+	assert(r->result == SQLITE_ROW && r->numcol == 1 && r->col[0].val.i64 == 5);
+	sqlasync_result_free(r);
+	check_done_res(qr);
+
+	/* Interned queries, the second use should reuse the prepared statement */
+	const char *sel = sqlasync_intern(sql, "SELECT ? + 1");
+	assert(sel != NULL && strcmp(sel, "SELECT ? + 1") == 0);
+	assert(sqlasync_intern(sql, "SELECT ? + 1") == sel);
+	for(i=0; i<3; i++)
+		sqlasync_sql(sql, qr, SQLASYNC_INTERNED, sel, 1, sqlasync_int(i));
+	for(i=0; i<3; i++) {
+		r = sqlasync_queue_get(qr);
+		assert(r->result == SQLITE_ROW && r->numcol == 1 && r->col[0].val.i64 == i+1);
+		sqlasync_result_free(r);
+		check_done_res(qr);
+	}
+	sqlasync_sql(sql, qr, SQLASYNC_INTERNED, sqlasync_intern(sql, "SELECT '"), 0);
+	check_err_res(qr);
+
+	/* Failure to prepare */
+	sqlasync_sql_many(sql, qr, SQLASYNC_STATIC, "INSERT INTO sqlasync_noexist VALUES (?)", 1, 1, rows);
+	check_err_res(qr);
+
 
 	sqlasync_destroy(sql);
 	sqlasync_queue_destroy(q);
@@ -190,6 +229,1430 @@ static void test_sql() {
 
 
 
+/* Submit queries and NEXT chains from multiple threads at the same time. */
+#define THREADS_NUM 8
+#define THREADS_ITER 200
+
+static void *threads_submit(void *dat) {
+	sqlasync_t *sql = dat;
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	int i;
+	for(i=0; i<THREADS_ITER; i++) {
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO threads VALUES (1)", 0);
+		sqlasync_lock(sql);
+		sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT, "INSERT INTO threads VALUES (2)", 0);
+		sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC, "SELECT COUNT(*) FROM threads", 0);
+		sqlasync_unlock(sql);
+	}
+	for(i=0; i<THREADS_ITER; i++) {
+		check_done_res(q);
+		check_done_res(q);
+		sqlasync_result_t *r = sqlasync_queue_get(q);
+		assert(r->result == SQLITE_ROW && r->numcol == 1);
+		sqlasync_result_free(r);
+		check_done_res(q);
+	}
+	sqlasync_queue_destroy(q);
+	return NULL;
+}
+
+
+static void test_threads() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	pthread_t t[THREADS_NUM];
+	int i;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE threads (x)", 0);
+	check_done_res(q);
+
+	for(i=0; i<THREADS_NUM; i++)
+		assert(pthread_create(t+i, NULL, threads_submit, sql) == 0);
+	for(i=0; i<THREADS_NUM; i++)
+		pthread_join(t[i], NULL);
+
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT COUNT(*) FROM threads", 0);
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == THREADS_NUM*THREADS_ITER*2);
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+
+
+static void test_busy() {
+	char fn[] = "/tmp/sqlasync-test-XXXXXX";
+	int fd = mkstemp(fn);
+	assert(fd >= 0);
+	close(fd);
+
+	sqlite3 *db;
+	assert(sqlite3_open(fn, &db) == SQLITE_OK);
+	assert(sqlite3_exec(db, "CREATE TABLE busy (x)", NULL, NULL, NULL) == SQLITE_OK);
+
+	sqlasync_t *sql = sqlasync_busy(sqlasync_create(NULL), 1, 10, 50);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_stats_t st;
+	sqlasync_open(sql, q, NULL, fn, 0);
+	check_ok_res(q);
+
+	/* Give up after the timeout */
+	assert(sqlite3_exec(db, "BEGIN EXCLUSIVE", NULL, NULL, NULL) == SQLITE_OK);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO busy VALUES (1)", 0);
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_BUSY && r->last && r->numcol == 1);
+	sqlasync_result_free(r);
+	sqlasync_stats(sql, &st);
+	assert(st.busy_retries > 0 && st.busy_timeouts == 1 && st.busy_wait >= 25000);
+
+	/* Succeed when the lock is released in time */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO busy VALUES (1)", 0);
+	usleep(10000);
+	assert(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	check_done_res(q);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlite3_close(db);
+	unlink(fn);
+}
+
+
+
+
+/* Runs a single-column query and checks its result as a string */
+#define check_pragma(_sql, _q, _query, _val) do {\
+		sqlasync_sql(_sql, _q, SQLASYNC_STATIC, _query, 0);\
+		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
+		assert(_r->result == SQLITE_ROW && _r->numcol == 1);\
+		sqlasync_value_t _v = _r->col[0];\
+		if(_v.type == SQLITE_INTEGER) {\
+			char _buf[32];\
+			snprintf(_buf, sizeof(_buf), "%lld", (long long)_v.val.i64);\
+			assert(strcmp(_buf, _val) == 0);\
+		} else\
+			assert(_v.type == SQLITE_TEXT && strcmp(_v.val.ptr, _val) == 0);\
+		sqlasync_result_free(_r);\
+		check_done_res(_q);\
+	} while(0)
+
+static void test_tune() {
+	char fn[] = "/tmp/sqlasync-test-XXXXXX", aux[64];
+	int fd = mkstemp(fn);
+	assert(fd >= 0);
+	close(fd);
+	unlink(fn);
+
+	sqlasync_tuning_t t = *sqlasync_tuning_preset("throughput");
+	t.page_size = "8192";
+	assert(sqlasync_tuning_preset("nonexistent") == NULL);
+
+	sqlasync_t *sql = sqlasync_tune(sqlasync_create(NULL), &t);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_open(sql, q, NULL, fn, 0);
+	check_ok_res(q);
+	check_pragma(sql, q, "PRAGMA journal_mode", "wal");
+	check_pragma(sql, q, "PRAGMA synchronous", "1");
+	check_pragma(sql, q, "PRAGMA cache_size", "-65536");
+	check_pragma(sql, q, "PRAGMA temp_store", "2");
+	check_pragma(sql, q, "PRAGMA page_size", "8192");
+	sqlasync_destroy(sql);
+
+	/* A bad setting fails the open */
+	t = *sqlasync_tuning_preset("durable");
+	t.synchronous = "FULL; SELECT * FROM nonexistent";
+	sql = sqlasync_tune(sqlasync_create(NULL), &t);
+	sqlasync_open(sql, q, q, fn, 0);
+	check_err_res(q);
+	check_ok_res(q);
+	sqlasync_destroy(sql);
+
+	sqlasync_queue_destroy(q);
+	unlink(fn);
+	snprintf(aux, sizeof(aux), "%s-wal", fn);
+	unlink(aux);
+	snprintf(aux, sizeof(aux), "%s-shm", fn);
+	unlink(aux);
+}
+
+
+
+
+static void test_backup() {
+	char fn[] = "/tmp/sqlasync-test-XXXXXX";
+	int fd = mkstemp(fn);
+	assert(fd >= 0);
+	close(fd);
+
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_queue_t *bq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	int progress = 0;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE bk (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 200) INSERT INTO bk SELECT randomblob(1000) FROM c", 0);
+	check_done_res(q);
+
+	sqlasync_backup(sql, bq, fn, 10, 1);
+	/* Only one backup at a time */
+	sqlasync_backup(sql, q, "/tmp/sqlasync-test-never", 10, 1);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_MISUSE && r->last);
+	sqlasync_result_free(r);
+	/* Writes continue and end up in the copy */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO bk VALUES (1)", 0);
+	check_done_res(q);
+
+	while(1) {
+		r = sqlasync_queue_get(bq);
+		if(r->last)
+			break;
+		assert(r->result == SQLITE_OK && r->numcol == 2);
+		assert(r->col[0].val.i64 < r->col[1].val.i64);
+		progress++;
+		sqlasync_result_free(r);
+	}
+	assert(r->result == SQLITE_DONE && r->numcol == 2);
+	assert(r->col[0].val.i64 > 20 && r->col[1].val.i64 > 0);
+	sqlasync_result_free(r);
+	assert(progress > 2);
+
+	sqlite3 *db;
+	sqlite3_stmt *st;
+	assert(sqlite3_open(fn, &db) == SQLITE_OK);
+	assert(sqlite3_prepare_v2(db, "SELECT count(*) FROM bk", -1, &st, NULL) == SQLITE_OK);
+	assert(sqlite3_step(st) == SQLITE_ROW && sqlite3_column_int(st, 0) == 201);
+	sqlite3_finalize(st);
+	sqlite3_close(db);
+
+	/* Errors are reported on the queue */
+	sqlasync_backup(sql, bq, "/nonexistent/sqlasync-test", 0, 0);
+	check_err_res(bq);
+
+	/* A backup that can't be completed at close still ends with an error */
+	assert(sqlite3_open(fn, &db) == SQLITE_OK);
+	assert(sqlite3_exec(db, "BEGIN EXCLUSIVE", NULL, NULL, NULL) == SQLITE_OK);
+	sqlasync_backup(sql, bq, fn, 10, 60000);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(q);
+	assert(sqlasync_queue_tryget(bq) == NULL);
+	sqlasync_close(sql);
+	r = sqlasync_queue_get(bq);
+	assert(r->last && (r->result == SQLITE_BUSY || r->result == SQLITE_LOCKED));
+	sqlasync_result_free(r);
+	sqlite3_close(db);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(bq);
+	unlink(fn);
+}
+
+
+
+
+/* Number of rows in the `p' table of a database file, or -1 if there's no such
+ * table or the file stays locked for longer than `busy' milliseconds */
+static int persist_count(const char *fn, int busy) {
+	sqlite3 *db;
+	sqlite3_stmt *st;
+	int n = -1;
+	assert(sqlite3_open(fn, &db) == SQLITE_OK);
+	sqlite3_busy_timeout(db, busy);
+	if(sqlite3_prepare_v2(db, "SELECT count(*) FROM p", -1, &st, NULL) == SQLITE_OK) {
+		assert(sqlite3_step(st) == SQLITE_ROW);
+		n = sqlite3_column_int(st, 0);
+	}
+	sqlite3_finalize(st);
+	sqlite3_close(db);
+	return n;
+}
+
+
+static void test_persist() {
+	char fn[] = "/tmp/sqlasync-test-XXXXXX";
+	int fd = mkstemp(fn);
+	assert(fd >= 0);
+	close(fd);
+
+	sqlasync_t *sql = sqlasync_persist(sqlasync_create(NULL), 20);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_queue_t *eq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	int i;
+
+	sqlasync_open(sql, q, eq, fn, 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE p (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO p VALUES (1)", 0);
+	check_done_res(q);
+	/* Copied in the background, without any further operations */
+	for(i=0; i<200 && persist_count(fn, 1000) != 1; i++)
+		usleep(10000);
+	assert(persist_count(fn, 1000) == 1);
+	sqlasync_destroy(sql);
+	check_ok_res(eq);
+
+	/* The file is loaded on open, and copied on close */
+	sql = sqlasync_persist(sqlasync_create(NULL), 60000);
+	sqlasync_open(sql, q, eq, fn, 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO p VALUES (2)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT count(*) FROM p", 0);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 2);
+	sqlasync_result_free(r);
+	check_done_res(q);
+	assert(persist_count(fn, 1000) == 1);
+	sqlasync_close(sql);
+	check_ok_res(eq);
+	assert(persist_count(fn, 1000) == 2);
+
+	sqlasync_open(sql, q, eq, "/nonexistent/sqlasync-test", 0);
+	check_err_res(q);
+	check_ok_res(eq);
+	sqlasync_destroy(sql);
+
+	/* Queries continue while the file is locked, the copy is retried */
+	sqlite3 *db;
+	sql = sqlasync_persist(sqlasync_create(NULL), 20);
+	sqlasync_open(sql, q, eq, fn, 0);
+	check_ok_res(q);
+	assert(sqlite3_open(fn, &db) == SQLITE_OK);
+	assert(sqlite3_exec(db, "BEGIN EXCLUSIVE", NULL, NULL, NULL) == SQLITE_OK);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO p VALUES (3)", 0);
+	check_done_res(q);
+	usleep(100000);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT count(*) FROM p", 0);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 3);
+	sqlasync_result_free(r);
+	check_done_res(q);
+	assert(sqlasync_queue_tryget(eq) == NULL);
+	assert(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+	for(i=0; i<200 && persist_count(fn, 1000) != 3; i++)
+		usleep(10000);
+	assert(persist_count(fn, 1000) == 3);
+	sqlasync_destroy(sql);
+	check_ok_res(eq);
+
+	/* A copy of a database larger than a single step completes while queries
+	 * keep writing to it */
+	sql = sqlasync_persist(sqlasync_create(NULL), 20);
+	sqlasync_open(sql, q, eq, fn, 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 20000) INSERT INTO p SELECT randomblob(1000) FROM c", 0);
+	check_done_res(q);
+	for(i=0; i<5000 && persist_count(fn, 0) < 20003; i++) {
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO p VALUES (4)", 0);
+		check_done_res(q);
+	}
+	assert(i < 5000);
+	sqlasync_destroy(sql);
+	check_ok_res(eq);
+	assert(persist_count(fn, 1000) == 20003+i);
+
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(eq);
+	unlink(fn);
+}
+
+
+
+
+/* A VFS that fails to open a main database file after `failopen' successful
+ * opens, for the checkpoint connection */
+static sqlite3_vfs failvfs, *failreal;
+static int failopen;
+
+static int failvfs_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *f, int flags, int *outflags) {
+	if((flags & SQLITE_OPEN_MAIN_DB) && failopen-- == 0)
+		return SQLITE_CANTOPEN;
+	return failreal->xOpen(failreal, name, f, flags, outflags);
+}
+
+
+static void test_checkpoint() {
+	char fn[] = "/tmp/sqlasync-test-XXXXXX", wal[64], uri[64];
+	int fd = mkstemp(fn);
+	assert(fd >= 0);
+	close(fd);
+	snprintf(wal, sizeof(wal), "%s-wal", fn);
+
+	sqlasync_t *sql = sqlasync_checkpoint(sqlasync_create(NULL), 10, SQLITE_CHECKPOINT_TRUNCATE);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_stats_t st;
+	struct stat sb;
+	int i;
+
+	sqlasync_open(sql, q, NULL, fn, 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "PRAGMA journal_mode=WAL", 0);
+	sqlasync_result_free(sqlasync_queue_get(q));
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE ckpt (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 200) INSERT INTO ckpt SELECT randomblob(1000) FROM c", 0);
+	check_done_res(q);
+
+	/* The WAL is larger than 10 pages, so the checkpoint is escalated */
+	for(i=0; i<200; i++) {
+		sqlasync_stats(sql, &st);
+		if(st.checkpoint_escalations)
+			break;
+		usleep(10000);
+	}
+	assert(st.checkpoints > 0 && st.checkpoint_escalations > 0);
+	assert(stat(wal, &sb) == 0 && sb.st_size == 0);
+
+	/* Reads don't cause checkpoints */
+	usleep(50000);
+	sqlasync_stats(sql, &st);
+	unsigned long long checkpoints = st.checkpoints;
+	for(i=0; i<5; i++) {
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 FROM ckpt LIMIT 0", 0);
+		check_done_res(q);
+		usleep(10000);
+	}
+	sqlasync_stats(sql, &st);
+	assert(st.checkpoints == checkpoints);
+	sqlasync_destroy(sql);
+
+	/* If the checkpoint connection can't be opened, SQLite keeps
+	 * checkpointing by itself and the error is reported */
+	sqlasync_queue_t *eq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	failreal = sqlite3_vfs_find(NULL);
+	failvfs = *failreal;
+	failvfs.zName = "sqlasync-fail";
+	failvfs.xOpen = failvfs_open;
+	assert(sqlite3_vfs_register(&failvfs, 0) == SQLITE_OK);
+	failopen = 1;
+	snprintf(uri, sizeof(uri), "file:%s?vfs=sqlasync-fail", fn);
+	sql = sqlasync_checkpoint(sqlasync_create(NULL), 10, SQLITE_CHECKPOINT_TRUNCATE);
+	sqlasync_open(sql, q, eq, uri, SQLITE_OPEN_READWRITE|SQLITE_OPEN_URI);
+	check_ok_res(q);
+	r = sqlasync_queue_get(eq);
+	assert(r->result == SQLITE_CANTOPEN && !r->last && r->numcol == 1);
+	sqlasync_result_free(r);
+	check_pragma(sql, q, "PRAGMA wal_autocheckpoint", "1000");
+	sqlasync_destroy(sql);
+	check_ok_res(eq);
+	sqlite3_vfs_unregister(&failvfs);
+
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(eq);
+	unlink(fn);
+}
+
+
+
+
+static void test_group() {
+	struct timespec timeout = { 10, 0 };
+	sqlasync_t *sql = sqlasync_group(sqlasync_create(&timeout), 10, 0, 0);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_queue_t *q2 = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	sqlasync_stats_t st;
+	int i;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE, "CREATE TABLE grp (x)", 0);
+	check_done_res(q);
+
+	/* Should commit after the 10th and 20th query */
+	for(i=0; i<25; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO grp VALUES (1)", 0);
+	for(i=0; i<25; i++)
+		check_done_res(q);
+	sqlasync_stats(sql, &st);
+	assert(st.commits == 2);
+
+	/* Durable results are held until the commit after the 10th query */
+	for(i=0; i<5; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_DURABLE, "INSERT INTO grp VALUES (1)", 0);
+	for(i=0; i<5; i++)
+		check_done_res(q);
+	sqlasync_stats(sql, &st);
+	assert(st.commits == 3);
+
+	/* A failing query only rolls back its own modifications */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE, "CREATE TABLE grpu (x UNIQUE)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_DURABLE, "INSERT INTO grpu VALUES (1)", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO grpu VALUES (1)", 0);
+	/* Including in a NEXT chain, the durable result should get an error */
+	sqlasync_lock(sql);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT|SQLASYNC_DURABLE, "INSERT INTO grpu VALUES (2)", 0);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC, "INSERT INTO grpu VALUES (2)", 0);
+	sqlasync_unlock(sql);
+	/* Later results on the same queue are held back as well */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 42", 0);
+	sqlasync_sql(sql, q2, SQLASYNC_STATIC, "SELECT 1 LIMIT 0", 0);
+	check_done_res(q2);
+	assert(sqlasync_queue_tryget(q) == NULL);
+	/* And with SQLASYNC_LAST, the remainder of the transaction is committed */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_LAST, "INSERT INTO grpu VALUES (1)", 0);
+	check_done_res(q); /* Durable result of the first query */
+	check_err_res(q);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ABORT && r->last);
+	sqlasync_result_free(r);
+	check_err_res(q);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 42);
+	sqlasync_result_free(r);
+	check_done_res(q);
+	check_err_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT x FROM grpu", 0);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 1);
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	/* A rolled back transaction doesn't count towards the next group */
+	sqlasync_stats(sql, &st);
+	for(i=0; i<4; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO grp VALUES (1)", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT OR ROLLBACK INTO grpu VALUES (1)", 0);
+	for(i=0; i<4; i++)
+		check_done_res(q);
+	check_err_res(q);
+	for(i=0; i<16; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO grp VALUES (1)", 0);
+	for(i=0; i<16; i++)
+		check_done_res(q);
+	unsigned long long commits = st.commits;
+	sqlasync_stats(sql, &st);
+	assert(st.commits == commits+1);
+	sqlasync_destroy(sql);
+
+	/* Should commit as soon as the queue is empty */
+	sqlasync_t *sqli = sqlasync_group(sqlasync_create(&timeout), 0, 0, SQLASYNC_GROUP_IDLE);
+	sqlasync_open(sqli, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sqli, q, SQLASYNC_STATIC, "SELECT 1 LIMIT 0", 0);
+	check_done_res(q);
+	usleep(100000);
+	sqlasync_stats(sqli, &st);
+	assert(st.commits == 1);
+
+	sqlasync_destroy(sqli);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(q2);
+}
+
+
+
+
+static int instrumentcount = 0;
+
+static void instrument_cb(sqlasync_t *sql, const sqlasync_opstat_t *st, void *data) {
+	assert(data == &instrumentcount);
+	assert(st->query != NULL);
+	if(strcmp(st->query, "SELECT x FROM instr WHERE x > ?") == 0) {
+		assert(st->result == SQLITE_DONE && st->rows == 2 && st->fullscan_steps > 0);
+		instrumentcount++;
+	}
+}
+
+
+static void test_instrument() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync(), *slow = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	sqlasync_stats_t st;
+
+	sqlasync_slowlog(sql, slow, 0);
+	sqlasync_instrument(sql, instrument_cb, &instrumentcount);
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE instr (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO instr VALUES (1), (2), (3)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT x FROM instr WHERE x > ?", 1, sqlasync_int(1));
+	r = sqlasync_queue_get(q);
+	sqlasync_result_free(r);
+	r = sqlasync_queue_get(q);
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	/* Everything is logged with a threshold of 0 */
+	r = sqlasync_queue_get(slow);
+	assert(r->result == SQLITE_DONE && r->numcol == 8 && !r->last);
+	assert(strcmp(r->col[0].val.ptr, "CREATE TABLE instr (x)") == 0);
+	sqlasync_result_free(r);
+	sqlasync_result_free(sqlasync_queue_get(slow));
+	r = sqlasync_queue_get(slow);
+	assert(r->col[3].val.i64 == 2 && r->col[4].val.i64 > 0);
+	assert(r->col[7].type == SQLITE_TEXT && strstr(r->col[7].val.ptr, "SCAN") != NULL);
+	sqlasync_result_free(r);
+
+	sqlasync_querystats(sql, q);
+	int n = 0;
+	while((r = sqlasync_queue_get(q))->result == SQLITE_ROW) {
+		assert(r->numcol == 8 && r->col[1].val.i64 == 1);
+		sqlasync_result_free(r);
+		n++;
+	}
+	assert(n == 3 && r->result == SQLITE_DONE && r->last);
+	sqlasync_result_free(r);
+
+	sqlasync_stats(sql, &st);
+	assert(st.ops == 3 && st.rows == 2 && st.slow_queries == 3);
+	assert(instrumentcount == 1);
+
+	sqlasync_destroy(sql);
+	check_ok_res(slow);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(slow);
+}
+
+
+
+
+static pthread_mutex_t blocklock = PTHREAD_MUTEX_INITIALIZER;
+
+static void block_thread(sqlasync_t *sql, sqlite3 *db, sqlasync_queue_t *q, int val_num, sqlasync_value_t *values) {
+	pthread_mutex_lock(&blocklock);
+	pthread_mutex_unlock(&blocklock);
+	sqlasync_queue_result(q, sqlasync_result_create(SQLITE_DONE, 1, 0));
+}
+
+
+static void test_prio() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync(), *bq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	int i;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+
+	/* Keep the database thread busy while queueing */
+	pthread_mutex_lock(&blocklock);
+	sqlasync_custom(sql, bq, block_thread, 0);
+	for(i=0; i<10; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT ?", 1, sqlasync_int(i));
+	sqlasync_lock(sql);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT|SQLASYNC_PRIO, "SELECT 100", 0);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT, "SELECT 101", 0);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_LAST, "SELECT 102", 0);
+	sqlasync_unlock(sql);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_PRIO, "SELECT 200", 0);
+	pthread_mutex_unlock(&blocklock);
+	check_done_res(bq);
+
+	/* The locked chain ends up in the lane of its first query */
+	int expect[] = { 100, 101, 102, 200, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+	for(i=0; i<14; i++) {
+		r = sqlasync_queue_get(q);
+		assert(r->result == SQLITE_ROW && r->col[0].val.i64 == expect[i]);
+		sqlasync_result_free(r);
+		check_done_res(q);
+	}
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(bq);
+}
+
+
+
+
+#define check_cancel_res(_q) do {\
+		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
+		assert(_r->result == SQLITE_INTERRUPT && _r->numcol == 1 && _r->last);\
+		assert(strcmp(_r->col[0].val.ptr, "Query has been cancelled") == 0);\
+		sqlasync_result_free(_r);\
+	} while(0)
+
+static void test_cancel() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync(), *q2 = sqlasync_queue_sync(), *bq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	int i;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE cancel (x)", 0);
+	check_done_res(q);
+
+	/* Queued queries */
+	pthread_mutex_lock(&blocklock);
+	sqlasync_custom(sql, bq, block_thread, 0);
+	for(i=0; i<3; i++)
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1", 0);
+	sqlasync_lock(sql);
+	sqlasync_sql_unlocked(sql, q2, SQLASYNC_STATIC|SQLASYNC_NEXT, "INSERT INTO cancel VALUES (1)", 0);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_LAST, "INSERT INTO cancel VALUES (2)", 0);
+	sqlasync_unlock(sql);
+	sqlasync_cancel(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT count(*) FROM cancel", 0);
+	pthread_mutex_unlock(&blocklock);
+	check_done_res(bq);
+
+	for(i=0; i<3; i++)
+		check_cancel_res(q);
+	check_done_res(q2);
+	check_cancel_res(q);
+	/* The NEXT chain has been rolled back */
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 0);
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	/* Running query */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 1000000000) SELECT count(*) FROM c", 0);
+	usleep(50000);
+	sqlasync_cancel(q);
+	check_cancel_res(q);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(q2);
+	sqlasync_queue_destroy(bq);
+}
+
+
+
+
+#define check_expired_res(_q) do {\
+		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
+		assert(_r->result == SQLITE_INTERRUPT && _r->numcol == 1 && _r->last);\
+		assert(strcmp(_r->col[0].val.ptr, "Query deadline exceeded") == 0);\
+		sqlasync_result_free(_r);\
+	} while(0)
+
+static void test_deadline() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync(), *bq = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	sqlasync_stats_t st;
+	struct timespec timeout = { 0, 20000000 }, deadline;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+
+	/* Expired while queued */
+	pthread_mutex_lock(&blocklock);
+	sqlasync_custom(sql, bq, block_thread, 0);
+	sqlasync_queue_timeout(q, &timeout);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1", 0);
+	sqlasync_queue_timeout(q, NULL);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 2", 0);
+	/* A deadline for a single query */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += 20000000;
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	sqlasync_sql_deadline(sql, q, SQLASYNC_STATIC, &deadline, "SELECT 3", 0);
+	usleep(50000);
+	pthread_mutex_unlock(&blocklock);
+	check_done_res(bq);
+	check_expired_res(q);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 2);
+	sqlasync_result_free(r);
+	check_done_res(q);
+	check_expired_res(q);
+
+	/* Expired while running */
+	sqlasync_queue_timeout(q, &timeout);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 1000000000) SELECT count(*) FROM c", 0);
+	check_expired_res(q);
+
+	sqlasync_stats(sql, &st);
+	assert(st.expired == 3);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(bq);
+}
+
+
+
+
+static void test_cursor() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync(), *cq = sqlasync_queue_sync();
+	sqlasync_cursor_t *c;
+	sqlasync_result_t *r;
+	int i, n;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC,
+		"CREATE TABLE cur AS WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 25) SELECT x FROM c", 0);
+	check_done_res(q);
+
+	/* Interned, to check that the cursor doesn't use the cached statement */
+	const char *query = sqlasync_intern(sql, "SELECT x FROM cur WHERE x > ? ORDER BY x");
+	c = sqlasync_cursor_open(sql, cq, SQLASYNC_INTERNED, query, 1, sqlasync_int(0));
+	check_ok_res(cq);
+
+	for(n=0; n<4; n++) {
+		sqlasync_cursor_next(sql, c, 10);
+		/* Other queries can still be executed in between pages */
+		sqlasync_sql(sql, q, SQLASYNC_INTERNED, query, 1, sqlasync_int(24));
+		r = sqlasync_queue_get(q);
+		assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 25);
+		sqlasync_result_free(r);
+		check_done_res(q);
+
+		for(i=0; i<(n < 2 ? 10 : n == 2 ? 5 : 0); i++) {
+			r = sqlasync_queue_get(cq);
+			assert(r->result == SQLITE_ROW && r->col[0].val.i64 == n*10+i+1 && !r->last);
+			sqlasync_result_free(r);
+		}
+		if(n < 2)
+			check_ok_res(cq);
+		else
+			check_done_res(cq);
+	}
+	sqlasync_cursor_close(sql, c);
+
+	/* Errors */
+	c = sqlasync_cursor_open(sql, cq, SQLASYNC_STATIC, "SELECT x FROM nonexistent", 0);
+	check_err_res(cq);
+	sqlasync_cursor_next(sql, c, 10);
+	check_err_res(cq);
+	sqlasync_cursor_close(sql, c);
+
+	/* A cursor that is still open when the database is closed */
+	c = sqlasync_cursor_open(sql, cq, SQLASYNC_STATIC, "SELECT x FROM cur", 0);
+	check_ok_res(cq);
+	sqlasync_close(sql);
+	sqlasync_cursor_next(sql, c, 10);
+	check_err_res(cq);
+	sqlasync_cursor_close(sql, c);
+
+	/* Cursors that are never closed are freed by sqlasync_destroy() */
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_cursor_open(sql, cq, SQLASYNC_STATIC, "SELECT 1", 0);
+	check_ok_res(cq);
+	sqlasync_cursor_open(sql, cq, SQLASYNC_STATIC, "SELECT x FROM nonexistent", 0);
+	check_err_res(cq);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(cq);
+}
+
+
+
+
+struct layout_row {
+	sqlite3_int64 id;
+	const char *name;
+	double score;
+	int flag;
+};
+
+static const sqlasync_field_t layout_fields[] = {
+	SQLASYNC_FIELD(0, SQLASYNC_FIELD_INT64,  struct layout_row, id),
+	SQLASYNC_FIELD(1, SQLASYNC_FIELD_TEXT,   struct layout_row, name),
+	SQLASYNC_FIELD(2, SQLASYNC_FIELD_DOUBLE, struct layout_row, score),
+	SQLASYNC_FIELD(3, SQLASYNC_FIELD_INT,    struct layout_row, flag)
+};
+
+static const sqlasync_layout_t layout = { sizeof(struct layout_row), 4, layout_fields };
+
+
+static void test_layout() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	int i, n = 0;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE lay (id, name, score, flag)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO lay VALUES"
+		" (1, 'one', 1.5, 1), (2, NULL, 2.5, 0), (3, 'three', 3.5, 1), (4, 'four', NULL, 0), (5, 'five', 5.5, 1)", 0);
+	check_done_res(q);
+
+	sqlasync_sql_layout(sql, q, SQLASYNC_STATIC, &layout, 2, "SELECT id, name, score, flag FROM lay WHERE id >= ? ORDER BY id", 1, sqlasync_int(1));
+	while((r = sqlasync_queue_get(q))->result == SQLITE_ROW) {
+		struct layout_row *rows = r->col[0].val.ptr;
+		assert(r->numcol == 2 && !r->last && r->col[1].val.i64 == (n < 4 ? 2 : 1));
+		for(i=0; i<r->col[1].val.i64; i++, n++) {
+			assert(rows[i].id == n+1);
+			assert(rows[i].flag == (n+1)%2);
+			assert(rows[i].score == (n == 3 ? 0.0 : n+1.5));
+			assert(n == 1 ? rows[i].name == NULL : rows[i].name != NULL);
+		}
+		if(rows[0].id == 5)
+			assert(strcmp(rows[0].name, "five") == 0);
+		else if(rows[0].id == 1)
+			assert(strcmp(rows[0].name, "one") == 0);
+		sqlasync_result_free(r);
+	}
+	assert(n == 5 && r->result == SQLITE_DONE && r->last);
+	sqlasync_result_free(r);
+
+	/* Strings that don't fit in the initial arena */
+	sqlasync_sql_layout(sql, q, SQLASYNC_STATIC, &layout, 10, "SELECT id, printf('%.*c', 1000, 'a'||id), score, flag FROM lay", 0);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[1].val.i64 == 5);
+	for(i=0; i<5; i++) {
+		const char *name = ((struct layout_row *)r->col[0].val.ptr)[i].name;
+		assert(strlen(name) == 1000 && name[999] == 'a');
+	}
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+
+
+struct visit_sum {
+	sqlite3_int64 sum;
+	int rows, stop, finished;
+};
+
+static int visit_sum(sqlasync_queue_t *q, sqlite3_stmt *st, void *data) {
+	struct visit_sum *v = data;
+	if(!st) {
+		sqlasync_result_t *r = sqlasync_result_create(SQLITE_ROW, 0, 1);
+		r->col[0] = sqlasync_int(v->sum);
+		sqlasync_queue_result(q, r);
+		v->finished++;
+		return 0;
+	}
+	v->sum += sqlite3_column_int64(st, 0);
+	return ++v->rows == v->stop;
+}
+
+
+static void test_visit() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	struct visit_sum v = { 0, 0, 0, 0 };
+	sqlasync_result_t *r;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+
+	sqlasync_sql_visit(sql, q, SQLASYNC_STATIC, visit_sum, &v,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < ?) SELECT x FROM c", 1, sqlasync_int(10000));
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && !r->last && r->col[0].val.i64 == 50005000);
+	sqlasync_result_free(r);
+	check_done_res(q);
+	assert(v.rows == 10000 && v.finished == 1);
+
+	/* Stopping early */
+	memset(&v, 0, sizeof(v));
+	v.stop = 5;
+	sqlasync_sql_visit(sql, q, SQLASYNC_STATIC, visit_sum, &v,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 100) SELECT x FROM c", 0);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].val.i64 == 15);
+	sqlasync_result_free(r);
+	check_done_res(q);
+
+	/* No aggregate on error */
+	memset(&v, 0, sizeof(v));
+	sqlasync_sql_visit(sql, q, SQLASYNC_STATIC, visit_sum, &v, "SELECT x FROM nonexistent", 0);
+	check_err_res(q);
+	assert(v.finished == 0);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+
+
+/* Checks a change notification with the given rowids of table `a' */
+static void check_changes(sqlasync_queue_t *q, int op, int n, ...) {
+	va_list l;
+	int i;
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && !r->last && r->numcol == 3*(unsigned int)n);
+	va_start(l, n);
+	for(i=0; i<n; i++) {
+		assert(r->col[i*3].type == SQLITE_TEXT && strcmp(r->col[i*3].val.ptr, "a") == 0);
+		assert(r->col[i*3+1].val.i64 == op);
+		assert(r->col[i*3+2].val.i64 == va_arg(l, int));
+	}
+	va_end(l);
+	sqlasync_result_free(r);
+}
+
+
+static void exec_all(sqlasync_t *sql, sqlasync_queue_t *q, const char **queries) {
+	for(; *queries; queries++) {
+		sqlasync_sql(sql, q, SQLASYNC_STATIC, *queries, 0);
+		sqlasync_result_free(sqlasync_queue_get(q));
+	}
+	/* Flush any pending notifications */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(q);
+}
+
+
+static void test_subscribe() {
+	struct timespec timeout = { 0, 10000000 };
+	const char *tables[] = { "A", NULL };
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_queue_t *sa = sqlasync_queue_sync();
+	sqlasync_queue_t *sall = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+
+	/* Not open yet */
+	sqlasync_subscribe(sql, sa, tables);
+	check_err_res(sa);
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	const char *init[] = { "CREATE TABLE a (x)", "CREATE TABLE b (x)", NULL };
+	exec_all(sql, q, init);
+	sqlasync_subscribe(sql, sa, tables);
+	sqlasync_subscribe(sql, sall, NULL);
+
+	const char *autocommit[] = { "INSERT INTO a (rowid, x) VALUES (1, 0)", "INSERT INTO b (rowid, x) VALUES (1, 0)", NULL };
+	exec_all(sql, q, autocommit);
+	check_changes(sa, SQLITE_INSERT, 1, 1);
+	check_changes(sall, SQLITE_INSERT, 1, 1);
+	r = sqlasync_queue_get(sall);
+	assert(r->numcol == 3 && strcmp(r->col[0].val.ptr, "b") == 0);
+	sqlasync_result_free(r);
+	assert(sqlasync_queue_tryget(sa) == NULL && sqlasync_queue_tryget(sall) == NULL);
+
+	/* Batched per transaction, without the rolled back parts */
+	const char *trans[] = {
+		"BEGIN",
+		"UPDATE a SET x = 1",
+		"SAVEPOINT sp",
+		"INSERT INTO a (rowid, x) VALUES (10, 0)",
+		"ROLLBACK TO sp",
+		"INSERT INTO a (rowid, x) VALUES (11, 0)",
+		"INSERT INTO a (rowid, x) VALUES (12, 0), (11, 0)",
+		"COMMIT",
+		NULL
+	};
+	exec_all(sql, q, trans);
+	r = sqlasync_queue_get(sa);
+	assert(r->numcol == 6);
+	assert(r->col[1].val.i64 == SQLITE_UPDATE && r->col[2].val.i64 == 1);
+	assert(r->col[4].val.i64 == SQLITE_INSERT && r->col[5].val.i64 == 11);
+	sqlasync_result_free(r);
+	sqlasync_result_free(sqlasync_queue_get(sall));
+
+	const char *rollback[] = {
+		"INSERT INTO a (rowid, x) VALUES (20, 0), (1, 0)",
+		"BEGIN",
+		"DELETE FROM a WHERE rowid = 1",
+		"ROLLBACK",
+		NULL
+	};
+	exec_all(sql, q, rollback);
+	assert(sqlasync_queue_tryget(sa) == NULL && sqlasync_queue_tryget(sall) == NULL);
+
+	/* Comments don't hide a ROLLBACK TO */
+	const char *comments[] = {
+		"BEGIN",
+		"SAVEPOINT sp",
+		"INSERT INTO a (rowid, x) VALUES (30, 0)",
+		"/* undo */ ROLLBACK TO sp",
+		"INSERT INTO a (rowid, x) VALUES (31, 0)",
+		"-- nested\nSAVEPOINT /* inner */ sp2",
+		"INSERT INTO a (rowid, x) VALUES (32, 0)",
+		"-- undo\nROLLBACK /* to */ TO sp2",
+		"COMMIT",
+		NULL
+	};
+	exec_all(sql, q, comments);
+	check_changes(sa, SQLITE_INSERT, 1, 31);
+	check_changes(sall, SQLITE_INSERT, 1, 31);
+	assert(sqlasync_queue_tryget(sa) == NULL && sqlasync_queue_tryget(sall) == NULL);
+
+	sqlasync_unsubscribe(sql, sa);
+	check_ok_res(sa);
+	sqlasync_destroy(sql);
+	check_ok_res(sall);
+
+	/* Grouped transactions roll back failed queries with a savepoint */
+	sql = sqlasync_create(&timeout);
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	exec_all(sql, q, init);
+	sqlasync_subscribe(sql, sa, NULL);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO a (rowid, x) VALUES (1, 0)", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO a (rowid, x) VALUES (2, 0), (1, 0)", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO a (rowid, x) VALUES (3, 0)", 0);
+	check_done_res(q);
+	check_err_res(q);
+	check_done_res(q);
+	check_changes(sa, SQLITE_INSERT, 2, 1, 3);
+	sqlasync_destroy(sql);
+	check_ok_res(sa);
+
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(sa);
+	sqlasync_queue_destroy(sall);
+}
+
+
+
+
+static void test_router() {
+	sqlasync_router_t *router = sqlasync_router_create(4, NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_result_t *r;
+	unsigned int i;
+	int n = 0;
+	sqlite3_int64 sum = 0;
+
+	for(i=0; i<4; i++) {
+		sqlasync_open(sqlasync_router_shard(router, i), q, NULL, ":memory:", 0);
+		check_ok_res(q);
+	}
+	assert(sqlasync_router_shard(router, 4) == NULL);
+	assert(sqlasync_router_route(router, 6) == sqlasync_router_shard(router, 2));
+
+	sqlasync_router_all(router, q, SQLASYNC_STATIC, "CREATE TABLE shard (x)", 0);
+	check_done_res(q);
+
+	for(i=0; i<20; i++) {
+		sqlasync_sql(sqlasync_router_route(router, i), q, SQLASYNC_STATIC, "INSERT INTO shard VALUES (?)", 1, sqlasync_int(i));
+		check_done_res(q);
+	}
+
+	/* Scatter-gather, with a bind value that has to be copied for each shard */
+	sqlasync_router_all(router, q, SQLASYNC_STATIC, "SELECT count(*), sum(x) FROM shard WHERE ? <> ''", 1, sqlasync_text(SQLASYNC_COPY, "x"));
+	while((r = sqlasync_queue_get(q))->result == SQLITE_ROW) {
+		assert(r->col[0].val.i64 == 5 && !r->last);
+		sum += r->col[1].val.i64;
+		sqlasync_result_free(r);
+		n++;
+	}
+	assert(n == 4 && sum == 190 && r->result == SQLITE_DONE && r->last);
+	sqlasync_result_free(r);
+
+	/* Failure on some of the shards */
+	sqlasync_sql(sqlasync_router_shard(router, 1), q, SQLASYNC_STATIC, "CREATE TABLE partial (x)", 0);
+	check_done_res(q);
+	sqlasync_router_all(router, q, SQLASYNC_STATIC, "SELECT * FROM partial", 0);
+	check_err_res(q);
+
+	sqlasync_router_destroy(router);
+	sqlasync_queue_destroy(q);
+}
+
+
+
+
+#define check_cached_res(_q, _val) do {\
+		sqlasync_result_t *_r = sqlasync_queue_get(_q);\
+		assert(_r->result == SQLITE_ROW && _r->col[0].val.i64 == _val);\
+		sqlasync_result_free(_r);\
+		check_done_res(_q);\
+	} while(0)
+
+static void test_cache() {
+	sqlasync_t *sql = sqlasync_cache(sqlasync_create(NULL), 1<<20);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_stats_t st;
+
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE ca (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE cb (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO ca VALUES (1)", 0);
+	check_done_res(q);
+
+	const char *query = "SELECT count(*) FROM ca WHERE x <> ?";
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 1);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 1);
+	/* Different bind values */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "b"));
+	check_cached_res(q, 1);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_hits == 1 && st.cache_misses == 2 && st.cache_invalidations == 0);
+
+	/* Writing to another table keeps the entries */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO cb VALUES (1)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 1);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_hits == 2 && st.cache_invalidations == 0);
+
+	/* Writing to the table invalidates them */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO ca VALUES (2)", 0);
+	check_done_res(q);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_invalidations == 2);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 2);
+
+	/* SQLASYNC_CACHE is ignored in a NEXT chain, so the result read within
+	 * the rolled back chain isn't cached */
+	sqlasync_lock(sql);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT, "INSERT INTO ca VALUES (3)", 0);
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_NEXT|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	sqlasync_sql_unlocked(sql, q, SQLASYNC_STATIC|SQLASYNC_LAST, "INSERT INTO nonexistent VALUES (1)", 0);
+	sqlasync_unlock(sql);
+	check_done_res(q);
+	check_cached_res(q, 3);
+	check_err_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 2);
+
+	/* And a schema change */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "CREATE TABLE cc (x)", 0);
+	check_done_res(q);
+	sqlasync_stats(sql, &st);
+	unsigned long long misses = st.cache_misses;
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 2);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_misses == misses+1);
+
+	/* Not served from the cache while an earlier query on the queue is
+	 * pending, it is executed after that query instead */
+	unsigned long long hits = st.cache_hits;
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_done_res(q);
+	check_cached_res(q, 2);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_hits == hits);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 2);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_hits == hits+1);
+	sqlasync_destroy(sql);
+
+	/* Results read within a grouped transaction are dropped when the entire
+	 * transaction is rolled back */
+	struct timespec timeout = { 10, 0 };
+	sql = sqlasync_cache(sqlasync_create(&timeout), 1<<20);
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE, "CREATE TABLE ca (x)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE, "CREATE TABLE cb (x)", 0);
+	check_done_res(q);
+	/* Only invalidates the entries of `cb' by itself */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_SINGLE,
+		"CREATE TRIGGER cbt AFTER INSERT ON cb BEGIN SELECT RAISE(ROLLBACK, 'no'); END", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO ca VALUES (1)", 0);
+	check_done_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 1);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "INSERT INTO cb VALUES (1)", 0);
+	check_err_res(q);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC|SQLASYNC_CACHE, query, 1, sqlasync_text(SQLASYNC_COPY, "a"));
+	check_cached_res(q, 0);
+	sqlasync_stats(sql, &st);
+	assert(st.cache_hits == 0 && st.cache_misses == 2);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+}
+
+
+
+
+static void test_getn() {
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_queue_t *bq = sqlasync_queue_sync();
+	sqlasync_result_t *res[4];
+	struct pollfd pfd = { sqlasync_queue_fd(q), POLLIN, 0 };
+	struct timespec start;
+	assert(pfd.fd >= 0);
+	assert(sqlasync_queue_fd(q) == pfd.fd);
+
+	assert(poll(&pfd, 1, 0) == 0);
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	assert(poll(&pfd, 1, -1) == 1);
+	assert(sqlasync_queue_getn(q, res, 4, -1) == 1);
+	assert(res[0]->result == SQLITE_OK && res[0]->last);
+	sqlasync_result_free(res[0]);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	/* Empty queue */
+	assert(sqlasync_queue_tryget(q) == NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert(sqlasync_queue_getn(q, res, 4, 20) == 0);
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert((end.tv_sec - start.tv_sec)*1000 + (end.tv_nsec - start.tv_nsec)/1000000 >= 19);
+
+	/* Everything available is taken at once, up to the limit */
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3 UNION ALL SELECT 4", 0);
+	sqlasync_sql(sql, bq, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(bq);
+	assert(poll(&pfd, 1, 0) == 1);
+	assert(sqlasync_queue_getn(q, res, 3, 0) == 3);
+	assert(res[0]->col[0].val.i64 == 1 && res[2]->col[0].val.i64 == 3);
+	sqlasync_result_free(res[0]);
+	sqlasync_result_free(res[1]);
+	sqlasync_result_free(res[2]);
+	assert(poll(&pfd, 1, 0) == 1);
+	assert(sqlasync_queue_getn(q, res, 4, 0) == 2);
+	assert(res[0]->col[0].val.i64 == 4 && res[1]->result == SQLITE_DONE && res[1]->last);
+	sqlasync_result_free(res[0]);
+	sqlasync_result_free(res[1]);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	sqlasync_sql(sql, bq, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(bq);
+	sqlasync_result_t *r = sqlasync_queue_tryget(q);
+	assert(r && r->result == SQLITE_DONE && r->last);
+	sqlasync_result_free(r);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_queue_destroy(bq);
+}
+
+
+
+
+static int budgetwoken = 0;
+static int budgetorder[128];
+static int budgetnum = 0;
+
+static void budget_wakeup(sqlasync_wakeup_t *w, void *data) {
+	__atomic_store_n(&budgetwoken, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void budget_result(sqlasync_queue_t *q, void *data) {
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r != NULL);
+	budgetorder[budgetnum++] = (int)(size_t)data;
+	sqlasync_result_free(r);
+}
+
+
+/* Reads everything it can get */
+static void budget_drain(sqlasync_queue_t *q, void *data) {
+	sqlasync_result_t *r;
+	while((r = sqlasync_queue_get(q)) != NULL) {
+		budgetnum++;
+		sqlasync_result_free(r);
+	}
+}
+
+
+static void test_budget() {
+	sqlasync_wakeup_t *w = sqlasync_wakeup_create(budget_wakeup, NULL, NULL);
+	sqlasync_t *sql = sqlasync_create(NULL);
+	sqlasync_queue_t *q = sqlasync_queue_sync();
+	sqlasync_open(sql, q, NULL, ":memory:", 0);
+	check_ok_res(q);
+
+	/* A large scan and a small query, both fully available before dispatch */
+	sqlasync_queue_t *big = sqlasync_queue_async(w, 1, budget_result, (void*)1);
+	sqlasync_queue_t *small = sqlasync_queue_async(w, 0, budget_result, (void*)2);
+	sqlasync_sql(sql, big, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 99) SELECT x FROM c", 0);
+	sqlasync_sql(sql, small, SQLASYNC_STATIC, "SELECT 1", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(q);
+	assert(__atomic_load_n(&budgetwoken, __ATOMIC_SEQ_CST));
+
+	/* The small query doesn't have to wait for the scan, and dispatch returns
+	 * when the budget runs out. */
+	sqlasync_wakeup_budget(w, 10, 0);
+	budgetwoken = 0;
+	sqlasync_dispatch(w);
+	assert(budgetnum == 10);
+	assert(budgetorder[0] == 1 && budgetorder[1] == 2 && budgetorder[2] == 1 && budgetorder[3] == 2);
+	assert(budgetorder[4] == 1 && budgetorder[9] == 1);
+	assert(budgetwoken);
+
+	int i, n = 0;
+	while(budgetwoken) {
+		budgetwoken = 0;
+		sqlasync_dispatch(w);
+		n++;
+	}
+	assert(n == 10);
+	assert(budgetnum == 102);
+	for(i=4; i<budgetnum; i++)
+		assert(budgetorder[i] == 1);
+
+	/* A time budget still lets a single callback through */
+	sqlasync_wakeup_budget(w, 0, 1);
+	sqlasync_sql(sql, big, SQLASYNC_STATIC, "SELECT 1 UNION ALL SELECT 2", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(q);
+	budgetnum = 0;
+	while(__atomic_exchange_n(&budgetwoken, 0, __ATOMIC_SEQ_CST))
+		sqlasync_dispatch(w);
+	assert(budgetnum == 3);
+
+	/* The budget counts results, so a callback draining a query with many
+	 * rows from a non-each queue is cut off as well */
+	sqlasync_queue_t *all = sqlasync_queue_async(w, 0, budget_drain, NULL);
+	sqlasync_wakeup_budget(w, 100, 0);
+	sqlasync_sql(sql, all, SQLASYNC_STATIC,
+		"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x < 1000) SELECT x FROM c", 0);
+	sqlasync_sql(sql, q, SQLASYNC_STATIC, "SELECT 1 WHERE 0", 0);
+	check_done_res(q);
+	budgetnum = 0;
+	n = 0;
+	while(__atomic_exchange_n(&budgetwoken, 0, __ATOMIC_SEQ_CST)) {
+		sqlasync_dispatch(w);
+		assert(budgetnum <= ++n*100);
+	}
+	assert(budgetnum == 1001 && n == 11);
+	sqlasync_queue_destroy(all);
+
+	sqlasync_queue_destroy(big);
+	sqlasync_queue_destroy(small);
+	sqlasync_destroy(sql);
+	sqlasync_queue_destroy(q);
+	sqlasync_wakeup_destroy(w);
+}
+
+
+
+
 static int schedcount = 0;
 static int event = 0;
 static int asyncpipe[2];
@@ -318,6 +1781,25 @@ static void test_async() {
 
 int main(int argc, char **argv) {
 	test_sql();
+	test_threads();
+	test_busy();
+	test_tune();
+	test_checkpoint();
+	test_backup();
+	test_persist();
+	test_group();
+	test_instrument();
+	test_prio();
+	test_cancel();
+	test_deadline();
+	test_cursor();
+	test_layout();
+	test_visit();
+	test_subscribe();
+	test_router();
+	test_cache();
+	test_budget();
+	test_getn();
 	test_async();
 	return 0;
 }
@@ -0,0 +1,118 @@
+/* Copyright (c) 2013 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if !defined(BENCH) && defined(NDEBUG)
+#error These tests should not be compiled with -DNDEBUG!
+#endif
+
+/* Without -DBENCH this runs a quick test of the libev adapter. With -DBENCH,
+ * it runs more queries and reports the number of event loop iterations (i.e.
+ * wakeups) and queries per second. */
+
+#ifdef BENCH
+#define QUERIES 200000
+#else
+#define QUERIES 1000
+#endif
+#define INFLIGHT 64
+
+#include "sqlasyncev.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+static sqlasync_t *sql;
+static sqlasync_wakeup_t *w;
+static int submitted, done;
+
+
+static sqlasync_wakeup_t *wakeup_create() {
+	return sqlasync_ev_wakeup(EV_DEFAULT);
+}
+
+static void wakeup_destroy() {
+	sqlasync_ev_wakeup_destroy(w);
+}
+
+
+static void result_cb(sqlasync_queue_t *q, void *data);
+
+static void submit() {
+	submitted++;
+	sqlasync_sql(sql, sqlasync_queue_async(w, 0, result_cb, NULL), SQLASYNC_STATIC, "SELECT ?", 1, sqlasync_int(submitted));
+}
+
+
+static void result_cb(sqlasync_queue_t *q, void *data) {
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_ROW && r->col[0].type == SQLITE_INTEGER);
+	sqlasync_result_free(r);
+	r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_DONE && r->last);
+	sqlasync_result_free(r);
+	sqlasync_queue_destroy(q);
+
+	done++;
+	if(submitted < QUERIES)
+		submit();
+}
+
+
+static void open_cb(sqlasync_queue_t *q, void *data) {
+	sqlasync_result_t *r = sqlasync_queue_get(q);
+	assert(r->result == SQLITE_OK && r->last);
+	sqlasync_result_free(r);
+	sqlasync_queue_destroy(q);
+
+	int i;
+	for(i=0; i<INFLIGHT; i++)
+		submit();
+}
+
+
+int main(int argc, char **argv) {
+	struct timespec start, end;
+	ev_default_loop(0);
+	w = wakeup_create();
+	sql = sqlasync_create(NULL);
+	sqlasync_open(sql, sqlasync_queue_async(w, 0, open_cb, NULL), NULL, ":memory:", 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Only returns when the wakeup object has released its loop reference */
+	ev_run(EV_DEFAULT_ 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	assert(done == QUERIES);
+
+#ifdef BENCH
+	double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+	unsigned int it = ev_iteration(EV_DEFAULT);
+	printf("%d queries in %.3fs, %u loop iterations\n", QUERIES, t, it);
+	printf("%.0f queries/s, %.0f wakeups/s, %.2f queries/wakeup\n", QUERIES/t, it/t, (double)QUERIES/it);
+#endif
+
+	sqlasync_destroy(sql);
+	wakeup_destroy();
+	return 0;
+}
+
+/* vim: set noet sw=4 ts=4: */